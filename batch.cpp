@@ -0,0 +1,374 @@
+#include <batch.h>
+#include <core.h>
+
+#include <thread>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+
+Batch::Batch() {
+	queues = NULL;
+	workers = 0;
+	out = NULL;
+
+	ram_size = 0;
+	huge = false;
+	jit = false;
+
+	retired = 0;
+	faulted = 0;
+	broken = false;
+}
+
+
+// loaded the first time a job names it
+static BatchImage *find_image(Batch *b, const char *name, uint64 ram_size, bool huge) {
+	for (uint64 i = 0; i < b->images.size(); i++)
+		if (strcmp(b->images[i]->name, name) == 0)
+			return b->images[i];
+
+	BatchImage *img = new BatchImage;
+	img->name = strdup(name);
+
+	if (!img->mem.init(ram_size, huge)) {
+		printf("Can not allocate %lu bytes of RAM!\n", ram_size);
+		return NULL;
+	}
+
+	if (!load_image(&img->mem, name, BIOS_OFFSET, &img->entry))
+		return NULL;
+
+	// a raw image starts at its first byte, like the BIOS
+	if (!img->entry.valid) {
+		img->entry.pc = 0;
+		img->entry.lo = BIOS_OFFSET;
+		img->entry.sp = BIOS_OFFSET;
+	}
+
+	snapshot_runs(&img->mem, &img->runs);
+	b->images.push_back(img);
+
+	return img;
+}
+
+// a job per line: the image, then any of rN=VALUE, in=FILE@ADDR and
+// out=ADDR:SIZE. # starts a comment, lines without an image are skipped
+bool Batch::load(const char *name) {
+	FILE *f = fopen(name, "r");
+
+	if (f == NULL) {
+		printf("File %s not found!\n", name);
+		return false;
+	}
+
+	char line[4096];
+	int number = 0;
+	bool ok = true;
+
+	while (ok && fgets(line, sizeof(line), f) != NULL) {
+		number++;
+
+		char *comment = strchr(line, '#');
+
+		if (comment != NULL)
+			*comment = 0;
+
+		char *word = strtok(line, " \t\r\n");
+
+		if (word == NULL)
+			continue;
+
+		BatchJob job;
+		job.image = find_image(this, word, ram_size, huge);
+		job.mask = 0;
+		job.input = NULL;
+		job.input_addr = 0;
+		job.output_addr = 0;
+		job.output_size = 0;
+
+		ok = job.image != NULL;
+
+		for (word = strtok(NULL, " \t\r\n"); ok && word != NULL; word = strtok(NULL, " \t\r\n")) {
+			uint8 reg;
+			uint64 value;
+			char *end = NULL;
+
+			if (parse_assignment(word, &reg, &value) && reg < REGISTERS_COUNT) {
+				job.mask |= 1 << reg;
+				job.regs[reg] = value;
+			} else if (strncmp(word, "in=", 3) == 0 && (end = strrchr(word, '@')) != NULL) {
+				*end = 0;
+				job.input = strdup(word + 3);
+				job.input_addr = strtoull(end + 1, &end, 0);
+			} else if (strncmp(word, "out=", 4) == 0) {
+				job.output_addr = strtoull(word + 4, &end, 0);
+				job.output_size = *end == ':' ? strtoull(end + 1, &end, 0) : 0;
+			} else {
+				end = word;
+			}
+
+			if (end != NULL && *end != 0) {
+				printf("%s:%d: can not make sense of %s\n", name, number, word);
+				ok = false;
+			}
+		}
+
+		if (ok && (job.output_addr > ram_size || job.output_size > ram_size - job.output_addr)) {
+			printf("%s:%d: output region does not fit in RAM\n", name, number);
+			ok = false;
+		}
+
+		jobs.push_back(job);
+	}
+
+	fclose(f);
+
+	return ok;
+}
+
+
+// its own first, stolen from the back of the others once those ran out
+bool Batch::next(uint32 worker, uint32 *job) {
+	for (uint32 i = 0; i < workers; i++) {
+		BatchQueue *q = &queues[(worker + i) % workers];
+		std::lock_guard<std::mutex> guard(q->lock);
+
+		if (q->jobs.empty())
+			continue;
+
+		if (i == 0) {
+			*job = q->jobs.front();
+			q->jobs.pop_front();
+		} else {
+			*job = q->jobs.back();
+			q->jobs.pop_back();
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
+// whether [lo, hi) lies inside one run, those come back the same for the
+// next job
+static bool inside_runs(BatchImage *img, uint64 lo, uint64 hi) {
+	if (lo >= hi)
+		return true;
+
+	for (uint64 i = 0; i < img->runs.size(); i++)
+		if (lo >= img->runs[i].addr && hi <= img->runs[i].addr + img->runs[i].size)
+			return true;
+
+	return false;
+}
+
+static bool load_input(Memory *mem, BatchJob *job, uint64 *size) {
+	int fd = open(job->input, O_RDONLY);
+
+	if (fd < 0) {
+		printf("File %s not found!\n", job->input);
+		return false;
+	}
+
+	struct stat st;
+	fstat(fd, &st);
+
+	*size = st.st_size;
+
+	bool ok = map_range(mem, fd, 0, job->input_addr, st.st_size);
+	close(fd);
+
+	return ok;
+}
+
+// each worker has RAM of its own, with its own code lines, so stores into
+// code by one job never flush what another worker decoded
+void Batch::work(uint32 worker) {
+	Memory mem;
+
+	// the other workers take over its jobs
+	if (!mem.init(ram_size, huge)) {
+		printf("Can not allocate %lu bytes of RAM!\n", ram_size);
+		__atomic_store_n(&broken, true, __ATOMIC_RELAXED);
+		return;
+	}
+
+	Core *core = new Core;
+	core->init(0, &mem);
+	core->use_jit = jit;
+
+	BatchImage *last = NULL;
+	bool used = false;
+	bool changed = true;
+	uint32 k;
+
+	while (next(worker, &k)) {
+		BatchJob *job = &jobs[k];
+		BatchResult result;
+
+		memset(&result, 0, sizeof(result));
+		result.job = k;
+
+		if (used && !mem.clear()) {
+			printf("Can not clear RAM!\n");
+			result.fault = BATCH_LOAD_FAILED;
+			write(&result, NULL);
+			__atomic_store_n(&broken, true, __ATOMIC_RELAXED);
+			break;
+		}
+
+		used = true;
+		core->clear();
+
+		// code decoded for another image, or one it changed, is stale now.
+		// So is code the last job decoded outside the image, clearing RAM
+		// took it away without a store noticing
+		if (job->image != last || changed || !inside_runs(job->image, core->decoded_lo, core->decoded_hi)) {
+			core->icache.flush();
+			core->bcache.flush();
+			core->jit.flush();
+		}
+
+		core->reset_decoded();
+		last = job->image;
+
+		BatchImage *img = job->image;
+
+		for (uint64 i = 0; i < img->runs.size(); i++)
+			memcpy(mem.base + img->runs[i].addr, img->mem.base + img->runs[i].addr, img->runs[i].size);
+
+		uint64 size = 0;
+
+		if (job->input != NULL && !load_input(&mem, job, &size)) {
+			result.fault = BATCH_LOAD_FAILED;
+			write(&result, NULL);
+			changed = true;
+			continue;
+		}
+
+		// the caches see the epoch move and flush themselves
+		if (size != 0)
+			mem.code_write_range(job->input_addr, size);
+
+		core->regs[REG_PC].ul = img->entry.pc;
+		core->regs[REG_LO].ul = img->entry.lo;
+		core->regs[REG_SP].ul = img->entry.sp;
+
+		for (int r = 0; r < REGISTERS_COUNT; r++)
+			if (job->mask & (1 << r))
+				core->regs[r].ur = job->regs[r];
+
+		core->set_flag(FLAG_RUNNING, 1);
+
+		uint64 epoch = mem.code_epoch_now();
+		Runner runner = budget;
+
+		result.reason = runner.run(core);
+		result.retired = runner.retired;
+		result.fault = core->fault_code;
+		result.fault_addr = core->fault_addr;
+
+		for (int r = 0; r < REGISTERS_COUNT; r++)
+			result.regs[r] = core->regs[r].ul;
+
+		result.output_size = job->output_size;
+		write(&result, mem.base + job->output_addr);
+
+		// stores into code by this job, which copying the image back in
+		// for the next one undoes without a store noticing
+		changed = mem.code_epoch_now() != epoch;
+	}
+
+	core->release();
+	delete core;
+	mem.release();
+}
+
+void Batch::write(BatchResult *result, uint8 *output) {
+	std::lock_guard<std::mutex> guard(out_lock);
+
+	fwrite(result, sizeof(*result), 1, out);
+
+	if (result->output_size != 0)
+		fwrite(output, 1, result->output_size, out);
+
+	retired += result->retired;
+
+	if (result->fault != FAULT_NONE)
+		faulted++;
+}
+
+
+// every job on `workers` threads, the results to output. Returns the
+// exit status, faulting jobs are results like any other
+int Batch::run(const char *output, uint32 _workers) {
+	double start = now();
+
+	out = fopen(output, "wb");
+
+	if (out == NULL) {
+		printf("Can not create %s!\n", output);
+		return 2;
+	}
+
+	BatchHeader header;
+	header.magic = BATCH_MAGIC;
+	header.version = BATCH_VERSION;
+	header.registers = REGISTERS_COUNT;
+	header.jobs = jobs.size();
+
+	fwrite(&header, sizeof(header), 1, out);
+
+	workers = _workers;
+	queues = new BatchQueue[workers];
+
+	// neighbouring jobs to the same worker
+	for (uint32 i = 0; i < jobs.size(); i++)
+		queues[(uint64)i * workers / jobs.size()].jobs.push_back(i);
+
+	std::thread *threads = new std::thread[workers];
+
+	for (uint32 i = 0; i < workers; i++)
+		threads[i] = std::thread(&Batch::work, this, i);
+
+	for (uint32 i = 0; i < workers; i++)
+		threads[i].join();
+
+	delete[] threads;
+
+	// left when every worker lost its RAM, the header promised a result
+	// for each job
+	for (uint32 i = 0; i < workers; i++) {
+		for (uint32 k : queues[i].jobs) {
+			BatchResult result;
+
+			memset(&result, 0, sizeof(result));
+			result.job = k;
+			result.fault = BATCH_LOAD_FAILED;
+			write(&result, NULL);
+		}
+	}
+
+	bool ok = !ferror(out);
+
+	if (fclose(out) != 0 || !ok) {
+		printf("Can not write %s!\n", output);
+		return 2;
+	}
+
+	fprintf(stderr, "%lu jobs, %u faulted, %lu instructions in %.3f s\n",
+			jobs.size(), faulted, retired, now() - start);
+
+	if (broken) {
+		printf("A worker could not set up its RAM, its jobs count as BATCH_LOAD_FAILED or ran elsewhere\n");
+		return 2;
+	}
+
+	return 0;
+}
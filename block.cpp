@@ -0,0 +1,101 @@
+#include <block.h>
+#include <core.h>
+
+
+void BlockCache::init(Memory *_mem) {
+	arena = new uint8[BCACHE_ARENA];
+	mem = _mem;
+	dirty_count = 0;
+
+	for (int i = 0; i < 256; i++)
+		op_counts[i] = 0;
+
+	flush();
+
+	stats = BlockStats();
+}
+
+void BlockCache::release() {
+	delete[] arena;
+	arena = NULL;
+}
+
+// drops every block at once, which also breaks all chains between them
+void BlockCache::flush() {
+	fold();
+
+	for (int i = 0; i < BCACHE_SIZE; i++)
+		table[i] = NULL;
+
+	used = 0;
+	epoch = mem->code_epoch_now();
+
+	stats.invalidations++;
+}
+
+
+// decodes the straight-line run starting at addr, NULL when the arena
+// is full (it is flushed then, the caller retries on the next lookup)
+Block *BlockCache::build(Core *core, uint64 addr) {
+	Instruction insns[BLOCK_MAX];
+	uint32 count = 0;
+	uint64 end = addr;
+
+	while (count < BLOCK_MAX) {
+		Instruction *in = &insns[count];
+
+		core->decode(end, in);
+		end += in->size;
+		count++;
+
+		if (in->flags & INSN_END)
+			break;
+	}
+
+	uint64 size = (sizeof(Block) + count * sizeof(Instruction) + 15) & ~15UL;
+
+	if (used + size > BCACHE_ARENA) {
+		flush();
+		return NULL;
+	}
+
+	Block *b = (Block*)(arena + used);
+	used += size;
+
+	b->addr = addr;
+	b->count = count;
+	b->execs = 0;
+	b->runs = 0;
+	b->next[0] = NULL;
+	b->next[1] = NULL;
+	b->code = NULL;
+
+	for (uint32 i = 0; i < count; i++)
+		b->insns[i] = insns[i];
+
+	table[(addr ^ (addr >> BCACHE_BITS)) & (BCACHE_SIZE - 1)] = b;
+	stats.misses++;
+
+	return b;
+}
+
+void BlockCache::link(Block *from, Block *to) {
+	if (from->next[0] == NULL)
+		from->next[0] = to;
+	else
+		from->next[1] = to;
+}
+
+// adds what the blocks run since the last time did to op_counts
+void BlockCache::fold() {
+	for (uint32 i = 0; i < dirty_count; i++) {
+		Block *b = dirty[i];
+
+		for (uint32 k = 0; k < b->count; k++)
+			op_counts[b->insns[k].op] += b->runs;
+
+		b->runs = 0;
+	}
+
+	dirty_count = 0;
+}
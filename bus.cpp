@@ -0,0 +1,53 @@
+#include <bus.h>
+
+#include <stdio.h>
+
+
+Bus bus;
+
+
+// false if the range overlaps another one
+bool Bus::claim(BusRange range) {
+	uint64 i = 0;
+
+	while (i < ranges.size() && ranges[i].start < range.start)
+		i++;
+
+	bool before = i == 0 || ranges[i - 1].start + ranges[i - 1].size <= range.start;
+	bool after = i == ranges.size() || range.start + range.size <= ranges[i].start;
+
+	if (range.size == 0 || range.start < BUS_BASE || !before || !after) {
+		printf("%s: can not claim %lx-%lx\n", range.name, range.start, range.start + range.size);
+		return false;
+	}
+
+	ranges.insert(ranges.begin() + i, range);
+
+	return true;
+}
+
+// the range holding the whole access, or NULL
+BusRange *Bus::find(uint64 addr, uint64 size) {
+	uint64 lo = 0;
+	uint64 hi = ranges.size();
+
+	// the last range starting at or below addr
+	while (lo < hi) {
+		uint64 mid = (lo + hi) / 2;
+
+		if (ranges[mid].start <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == 0)
+		return NULL;
+
+	BusRange *r = &ranges[lo - 1];
+
+	if (addr - r->start >= r->size || size > r->size - (addr - r->start))
+		return NULL;
+
+	return r;
+}
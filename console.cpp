@@ -0,0 +1,90 @@
+#include <console.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+Console console;
+
+
+static void console_read(void *device, uint64 offset, uint8 size, uint8 *data) {
+	memset(data, 0, size);
+}
+
+static void console_write(void *device, uint64 offset, uint8 size, const uint8 *data) {
+	Console *c = (Console*)device;
+
+	if (offset == CONSOLE_DATA)
+		c->put(data, size);
+	else if (offset == CONSOLE_FLUSH)
+		c->flush();
+}
+
+
+Console::Console() {
+	fd = -1;
+	lines = false;
+	used = 0;
+}
+
+Console::~Console() {
+	flush();
+}
+
+
+// output to name, NULL is stdout. Claims the registers on the bus
+bool Console::open(const char *name) {
+	fd = name == NULL ? STDOUT_FILENO : ::open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0) {
+		printf("Can not create %s!\n", name);
+		return false;
+	}
+
+	lines = isatty(fd);
+
+	BusRange range = {CONSOLE_BASE, CONSOLE_SIZE, "console", this, console_read, console_write};
+
+	return bus.claim(range);
+}
+
+void Console::put(const uint8 *data, uint64 size) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	for (uint64 i = 0; i < size; i++) {
+		if (used == CONSOLE_BUFFER)
+			flush_locked();
+
+		buffer[used++] = data[i];
+
+		if (lines && data[i] == '\n')
+			flush_locked();
+	}
+}
+
+void Console::flush() {
+	std::lock_guard<std::mutex> guard(lock);
+	flush_locked();
+}
+
+// stdout may hold the emulator's own output, that came first
+void Console::flush_locked() {
+	if (used == 0 || fd < 0)
+		return;
+
+	if (fd == STDOUT_FILENO)
+		fflush(stdout);
+
+	for (uint32 done = 0; done < used; ) {
+		ssize_t n = ::write(fd, buffer + done, used - done);
+
+		if (n <= 0)
+			break;
+
+		done += n;
+	}
+
+	used = 0;
+}
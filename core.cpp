@@ -1,7 +1,21 @@
 #include <core.h>
-
-
-extern uint8 *ram;
+#include <trace.h>
+#include <smp.h>
+#include <fork.h>
+#include <irq.h>
+#include <bus.h>
+
+
+thread_local Core *current_core;
+
+const char *fault_names[] = {
+	"no fault",
+	"access outside RAM",
+	"instruction outside RAM",
+	"illegal instruction",
+	"misaligned atomic",
+	"page fault",
+};
 
 
 Core::Core() {
@@ -9,20 +23,63 @@ Core::Core() {
 }
 
 
-void Core::init(uint8 _id) {
+void Core::init(uint8 _id, Memory *_mem) {
 	id = _id;
+	mem = _mem;
+	insn = NULL;
+	block = NULL;
+	fault_jmp = NULL;
+
+	icache.init(mem);
+	bcache.init(mem);
+	jit.init();
+
+	use_jit = false;
+	reset_decoded();
+
+	counters.clear();
+	mmu.stats.hits = 0;
+	mmu.stats.misses = 0;
+	irq.clear();
+	irq.waiting = false;
+	irq.waiter = &irq.own;
 
 	clear();
 }
 
 
+// frees the caches, the core can not run afterwards
+void Core::release() {
+	icache.release();
+	bcache.release();
+	jit.release();
+}
+
+
 void Core::clear() {
 	for (int i = 0; i < REGISTERS_COUNT; i++)
 		regs[i].ur = 0;
+
+	flag = 0;
+	lazy_flags = false;
+
+	fault_code = FAULT_NONE;
+	fault_addr = 0;
+
+	mmu.root = 0;
+	mmu.flush();
+
+	if (irq.timer_ns != 0)
+		timers.set(this, 0);
+
+	irq.clear();
 }
 
 
 void Core::set_flag(uint8 id, uint8 val) {
+	if (lazy_flags && ((1 << id) & FLAGS_ALU))
+		materialize_flags();
+
 	if (val == 0) {
 		flag &= ~(1 << id);
 	} else {
@@ -31,1165 +88,995 @@ void Core::set_flag(uint8 id, uint8 val) {
 }
 
 uint8 Core::get_flag(uint8 id) {
-	return (flag >> id) & 1;
-}
-
-
-void Core::print_info() {
-	LOG("Core: %0x\n", id);
-
-	for (int i = 0; i < REGISTERS_COUNT; i++) {
-		LOG("\t%-3d %016lx%016lx", i,
-				(uint64)(regs[i].ur >> 64), regs[i].ul);//, regs[i].ul, regs[i].ui, regs[i].us, regs[i].ub);
+	if (lazy_flags && ((1 << id) & FLAGS_ALU))
+		materialize_flags();
 
-		if (i % 2 == 1)
-			putc('\n', stdout);
-	}
+	return (flag >> id) & 1;
 }
 
-void Core::illegal() {
-	LOG("\e[1;31m%-6s\e[m", "Illegal instruction!\n");
-}
+void Core::materialize_flags() {
+	flag &= ~FLAGS_ALU;
 
+	if (last_a == last_b)
+		flag |= 1 << FLAG_EQUALS;
 
-uint8 Core::pop1(uint64 addr) {
-	return ram[addr];
-}
+	if (last_a > last_b)
+		flag |= 1 << FLAG_MORE;
 
-uint16 Core::pop2(uint64 addr) {
-	return
-		((uint16)(ram[addr + 0]) << 0) |
-		((uint16)(ram[addr + 1]) << 8);
-}
+	if (last_a < last_b)
+		flag |= 1 << FLAG_LESS;
 
-uint32 Core::pop4(uint64 addr) {
-	return
-		((uint32)(ram[addr + 0]) <<  0) |
-		((uint32)(ram[addr + 1]) <<  8) |
-		((uint32)(ram[addr + 2]) << 16) |
-		((uint32)(ram[addr + 3]) << 24);
+	lazy_flags = false;
 }
 
-uint64 Core::pop8(uint64 addr) {
-	return
-		((uint64)(ram[addr + 0]) <<  0) |
-		((uint64)(ram[addr + 1]) <<  8) |
-		((uint64)(ram[addr + 2]) << 16) |
-		((uint64)(ram[addr + 3]) << 24) |
-		((uint64)(ram[addr + 4]) << 32) |
-		((uint64)(ram[addr + 5]) << 40) |
-		((uint64)(ram[addr + 6]) << 48) |
-		((uint64)(ram[addr + 7]) << 56);
-}
-
-uint128 Core::pop16(uint64 addr) {
-	return
-		((uint128)(ram[addr + 0]) << 0) |
-		((uint128)(ram[addr + 1]) << 8) |
-		((uint128)(ram[addr + 2]) << 16) |
-		((uint128)(ram[addr + 3]) << 24) |
-		((uint128)(ram[addr + 4]) << 32) |
-		((uint128)(ram[addr + 5]) << 40) |
-		((uint128)(ram[addr + 6]) << 48) |
-		((uint128)(ram[addr + 7]) << 56) |
-		((uint128)(ram[addr + 8]) << 64) |
-		((uint128)(ram[addr + 9]) << 72) |
-		((uint128)(ram[addr +10]) << 80) |
-		((uint128)(ram[addr +11]) << 88) |
-		((uint128)(ram[addr +12]) << 96) |
-		((uint128)(ram[addr +13]) << 104) |
-		((uint128)(ram[addr +14]) << 112) |
-		((uint128)(ram[addr +15]) << 120);
-}
-
-template<class T> void Core::push(T val, uint64 addr) {
-	for (int i = 0; i < sizeof(val); i++) {
-		ram[addr + i] = (val >> (i << 3)) & 0xff;
+bool Core::condition(uint8 cond) {
+	if (lazy_flags) {
+		switch (cond) {
+			case COND_E:  return last_a == last_b;
+			case COND_NE: return last_a != last_b;
+			case COND_B:  return last_a > last_b;
+			case COND_BE: return last_a >= last_b;
+			case COND_L:  return last_a < last_b;
+			case COND_LE: return last_a <= last_b;
+		}
 	}
-};
 
-
-template<class T> T Core::ALU(T a, T b, uint8 op) {
-	set_flag(FLAG_EQUALS, 0);
-	set_flag(FLAG_LESS, 0);
-	set_flag(FLAG_MORE, 0);
-
-	T sign_bit = (T)1 << (sizeof(T) * 8 - 1);
-	T ia = a;
-	T ib = b;
-
-	if ((a & sign_bit) == sign_bit)
-		ia = ~a + 1;
-
-	if ((b & sign_bit) == sign_bit)
-		ib = ~b + 1;
-
-	T sum = a + b;
-	T sub = a - b;
-	T mul = a * b;
-	T div = a / b;
-	T idiv = ia / ib;
-
-	if (((a & sign_bit) == sign_bit) ^ ((b & sign_bit) == sign_bit)) {
-		idiv = ~(idiv - 1);
+	switch (cond) {
+		case COND_E:  return get_flag(FLAG_EQUALS);
+		case COND_NE: return !get_flag(FLAG_EQUALS);
+		case COND_B:  return get_flag(FLAG_MORE);
+		case COND_BE: return get_flag(FLAG_MORE) || get_flag(FLAG_EQUALS);
+		case COND_L:  return get_flag(FLAG_LESS);
+		case COND_LE: return get_flag(FLAG_LESS) || get_flag(FLAG_EQUALS);
 	}
 
-	//T imul = a * b;//(a * b) & ((1 << (sizeof(T) >> 1)) - 1);
-
-	if (a == b)
-		set_flag(FLAG_EQUALS, 1);
-
-	if (a > b)
-		set_flag(FLAG_MORE, 1);
-
-	if (a < b)
-		set_flag(FLAG_LESS, 1);
-
-	if (op == ALU_SUM)
-		return sum;
-
-	if (op == ALU_SUB)
-		return sub;
-
-	if (op == ALU_MUL)
-		return mul;
-
-	/*if (op == ALU_IMUL)
-		return imul;*/
-
-	if (op == ALU_DIV)
-		return div;
-
-	if (op == ALU_IDIV)
-		return idiv;
-
-	return 0;
+	return false;
 }
 
 
-void Core::step() {
-	print_info();
-
-	uint8 i1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-
-	if (i1 == 0x00) { // nop
-		LOG("nop\n");
-	}
-
-	if (i1 == 0x01) { // hlt
-		LOG("hlt\n");
-		set_flag(FLAG_RUNNING, 0);
-	}
-
-	if (i1 == 0x02) { // movb n
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-
-		LOG("movb %%%d %02x\n", p1, p2);
-
-		regs[p1].ub = p2;
-	}
-
-	if (i1 == 0x03) { // movs n
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint16 p2 = pop2(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 2;
-
-		LOG("movs %%%d %04x\n", p1, p2);
-
-		regs[p1].us = p2;
-	}
-
-	if (i1 == 0x04) { // movi n
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint32 p2 = pop4(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 4;
-
-		LOG("movi %%%d %08x\n", p1, p2);
-
-		regs[p1].ui = p2;
-	}
-
-	if (i1 == 0x05) { // movl n
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint64 p2 = pop8(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 8;
-
-		LOG("movl %%%d %016lx\n", p1, p2);
-
-		regs[p1].ul = p2;
-	}
-
-	if (i1 == 0x06) { // movr n
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint128 p2 = pop16(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 16;
-
-		LOG("movr %%%d %016lx%016lx\n", p1, (uint64)(p2 >> 64),(uint64)p2);
-
-		regs[p1].ur = p2;
-	}
-
-	if (i1 == 0x07) { // movb r
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-
-		LOG("movb %%%d %%%d\n", p1,p2);
-
-		regs[p1].ub = regs[p1].ub;
-	}
-
-	if (i1 == 0x08) { // movs r
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-
-		LOG("movs %%%d %%%d\n", p1,p2);
-
-		regs[p1].us = regs[p1].us;
-	}
-
-	if (i1 == 0x09) { // movi r
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-
-		LOG("movi %%%d %%%d\n", p1,p2);
-
-		regs[p1].ui = regs[p1].ui;
-	}
-
-	if (i1 == 0x0a) { // movl r
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-
-		LOG("movl %%%d %%%d\n", p1,p2);
-
-		regs[p1].ul = regs[p1].ul;
-	}
-
-	if (i1 == 0x0b) { // movr r
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-
-		LOG("movr %%%d %%%d\n", p1,p2);
-
-		regs[p1].ur = regs[p1].ur;
-	}
-
-	if (i1 == 0x0c) { // movb from RAM
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint64 p2 = pop8(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 8;
-
-		LOG("movb %%%d [%016lx]\n", p1,p2);
-
-		regs[p1].ub = pop1(p2 + regs[REG_LO].ul);
-	}
-
-	if (i1 == 0x0d) { // movs from RAM
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint64 p2 = pop8(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 8;
-
-		LOG("movs %%%d [%016lx]\n", p1,p2);
-
-		regs[p1].us = pop2(p2 + regs[REG_LO].ul);
-	}
-
-	if (i1 == 0x0e) { // movi from RAM
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint64 p2 = pop8(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 8;
-
-		LOG("movi %%%d [%016lx]\n", p1,p2);
-
-		regs[p1].ui = pop4(p2 + regs[REG_LO].ul);
-	}
-
-	if (i1 == 0x0f) { // movl from RAM
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint64 p2 = pop8(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 8;
-
-		LOG("movl %%%d [%016lx]\n", p1,p2);
-
-		regs[p1].ul = pop8(p2 + regs[REG_LO].ul);
-	}
-
-	if (i1 == 0x10) { // movr from RAM
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint64 p2 = pop8(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 8;
-
-		LOG("movr %%%d [%016lx]\n", p1,p2);
-
-		regs[p1].ur = pop16(p2 + regs[REG_LO].ul);
-	}
-
-	if (i1 == 0x11) { // movb to RAM
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint64 p2 = pop8(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 8;
-
-		LOG("movb [%016lx] %%%d\n", p2,p1);
-
-		push(regs[p1].ub, p2 + regs[REG_LO].ul);
-	}
-
-	if (i1 == 0x12) { // movs to RAM
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint64 p2 = pop8(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 8;
-
-		LOG("movs [%016lx] %%%d\n", p2,p1);
-
-		push(regs[p1].us,p2 + regs[REG_LO].ul);
-	}
-
-	if (i1 == 0x13) { // movi to RAM
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint64 p2 = pop8(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 8;
-
-		LOG("movi [%016lx] %%%d\n", p2,p1);
-
-		push(regs[p1].ui,p2 + regs[REG_LO].ul);
-	}
-
-	if (i1 == 0x14) { // movl to RAM
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint64 p2 = pop8(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 8;
-
-		LOG("movl [%016lx] %%%d\n", p2,p1);
-
-		push(regs[p1].ul,p2 + regs[REG_LO].ul);
-	}
-
-	if (i1 == 0x15) { // movr to RAM
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint64 p2 = pop8(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 8;
-
-		LOG("movr [%016lx] %%%d\n", p2,p1);
-
-		push(regs[p1].ur,p2 + regs[REG_LO].ul);
-	}
-
-	if (i1 == 0x16) { // movb from RAMg
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint64 p2 = pop8(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 8;
-
-		LOG("movb %%%d {%016lx}\n", p1,p2);
-
-		regs[p1].ub = pop1(p2);
-	}
-
-	if (i1 == 0x17) { // movs from RAMg
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint64 p2 = pop8(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 8;
-
-		LOG("movs %%%d {%016lx}\n", p1,p2);
-
-		regs[p1].us = pop2(p2 + regs[REG_LO].ul);
-	}
-
-	if (i1 == 0x18) { // movi from RAMg
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint64 p2 = pop8(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 8;
-
-		LOG("movi %%%d {%016lx}\n", p1,p2);
-
-		regs[p1].ui = pop4(p2);
-	}
-
-	if (i1 == 0x19) { // movl from RAMg
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint64 p2 = pop8(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 8;
-
-		LOG("movl %%%d {%016lx}\n", p1,p2);
-
-		regs[p1].ul = pop8(p2);
-	}
-
-	if (i1 == 0x1a) { // movr from RAMg
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint64 p2 = pop8(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 8;
-
-		LOG("movr %%%d {%016lx}\n", p1,p2);
-
-		regs[p1].ur = pop16(p2);
-	}
-
-	if (i1 == 0x1b) { // movb to RAMg
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint64 p2 = pop8(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 8;
-
-		LOG("movb {%016lx} %%%d\n", p2,p1);
-
-		push(regs[p1].ub, p2);
-	}
-
-	if (i1 == 0x1c) { // movs to RAMg
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint64 p2 = pop8(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 8;
-
-		LOG("movs {%016lx} %%%d\n", p2,p1);
-
-		push(regs[p1].us,p2);
-	}
-
-	if (i1 == 0x1d) { // movi to RAMg
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint64 p2 = pop8(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 8;
-
-		LOG("movi {%016lx} %%%d\n", p2,p1);
-
-		push(regs[p1].ui,p2);
-	}
-
-	if (i1 == 0x1e) { // movl to RAMg
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint64 p2 = pop8(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 8;
-
-		LOG("movl {%016lx} %%%d\n", p2,p1);
-
-		push(regs[p1].ul,p2);
-	}
-
-	if (i1 == 0x1f) { // movr to RAMg
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint64 p2 = pop8(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 8;
-
-		LOG("movr {%016lx} %%%d\n", p2,p1);
-
-		push(regs[p1].ur,p2);
-	}
-
-	if (i1 == 0x20) { // movb from RAMr
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-
-		LOG("movb %%%d [%%%d]\n", p1,p2);
-
-		regs[p1].ub = pop1(regs[p2].ul + regs[REG_LO].ul);
-	}
-
-	if (i1 == 0x21) { // movs from RAMr
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-
-		LOG("movs %%%d [%%%d]\n", p1,p2);
-
-		regs[p1].us = pop2(regs[p2].ul + regs[REG_LO].ul);
-	}
-
-	if (i1 == 0x22) { // movi from RAMr
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-
-		LOG("movi %%%d [%%%d]\n", p1,p2);
-
-		regs[p1].ui = pop4(regs[p2].ul + regs[REG_LO].ul);
-	}
-
-	if (i1 == 0x23) { // movl from RAMr
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-
-		LOG("movl %%%d [%%%d]\n", p1,p2);
-
-		regs[p1].ul = pop8(regs[p2].ul + regs[REG_LO].ul);
-	}
-
-	if (i1 == 0x24) { // movr from RAMr
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-
-		LOG("movr %%%d [%%%d]\n", p1,p2);
-
-		regs[p1].ur = pop16(regs[p2].ul + regs[REG_LO].ul);
-	}
-
-	if (i1 == 0x25) { // movb to RAMr
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-
-		LOG("movb [%%%d] %%%d\n", p2,p1);
-
-		push(regs[p1].ub,regs[p2].ul + regs[REG_LO].ul);
-	}
-
-	if (i1 == 0x26) { // movs to RAMr
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-
-		LOG("movs [%%%d] %%%d\n", p2,p1);
-
-		push(regs[p1].us,regs[p2].ul + regs[REG_LO].ul);
-	}
-
-	if (i1 == 0x27) { // movi to RAMr
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-
-		LOG("movi [%%%d] %%%d\n", p2,p1);
-
-		push(regs[p1].ui,regs[p2].ul + regs[REG_LO].ul);
-	}
-
-	if (i1 == 0x28) { // movl to RAMr
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-
-		LOG("movl [%%%d] %%%d\n", p2,p1);
-
-		push(regs[p1].ul,regs[p2].ul + regs[REG_LO].ul);
-	}
-
-	if (i1 == 0x29) { // movr to RAMr
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-
-		LOG("movr [%%%d] %%%d\n", p2,p1);
-
-		push(regs[p1].ur,regs[p2].ul + regs[REG_LO].ul);
-	}
-
-	if (i1 == 0x2a) { // pushb n
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-
-		LOG("pushb %02x\n", p1);
-
-		regs[REG_SP].ul -= 1;
-		push(p1,regs[REG_SP].ul + regs[REG_LO].ul);
-	}
-
-	if (i1 == 0x2b) { // pushs n
-		uint16 p1 = pop2(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 2;
-
-		LOG("pushs %04x\n", p1);
-
-		regs[REG_SP].ul -= 2;
-		push(p1,regs[REG_SP].ul + regs[REG_LO].ul);
-	}
-
-	if (i1 == 0x2c) { // pushi n
-		uint32 p1 = pop4(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 4;
+void Core::print_info() {
+	trace.write("Core: %0x\n", id);
 
-		LOG("pushi %08x\n", p1);
+	for (int i = 0; i < REGISTERS_COUNT; i++) {
+		trace.write("\t%-3d %016lx%016lx", i,
+				(uint64)(regs[i].ur >> 64), regs[i].ul);
 
-		regs[REG_SP].ul -= 4;
-		push(p1,regs[REG_SP].ul + regs[REG_LO].ul);
+		if (i % 2 == 1)
+			trace.write("\n");
 	}
+}
 
-	if (i1 == 0x2d) { // pushl n
-		uint64 p1 = pop8(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 8;
-
-		LOG("pushl %016lx\n", p1);
+uint64 Core::read_sr(uint8 sr) {
+	switch (sr) {
+		case SR_MMU_ROOT:   return mmu.root;
+		case SR_TLB_FLUSH:  return 0;
+		case SR_TLB_HITS:   return mmu.stats.hits;
+		case SR_TLB_MISSES: return mmu.stats.misses;
+		case SR_FORK_INDEX: return forks.index;
+
+		case SR_IRQ_VECTOR:  return irq.vector;
+		case SR_IRQ_MASK:    return irq.mask;
+		case SR_IRQ_ENABLE:  return irq.enable;
+		case SR_IRQ_PENDING: return __atomic_load_n(&irq.pending, __ATOMIC_ACQUIRE);
+		case SR_IRQ_CAUSE:   return irq.cause;
+		case SR_IRQ_PC:      return irq.pc;
+		case SR_TIMER_INSNS: return irq.timer_insns;
+		case SR_TIMER_NS:    return irq.timer_ns;
+		case SR_DOORBELL:    return __atomic_exchange_n(&irq.doorbell, 0, __ATOMIC_ACQUIRE);
+	}
+
+	fault(FAULT_ILLEGAL, insn->addr);
+}
 
-		regs[REG_SP].ul -= 8;
-		push(p1,regs[REG_SP].ul + regs[REG_LO].ul);
-	}
+// decoded code is keyed by virtual address, so new translations drop it
+// on every core like a store into code does
+void Core::write_sr(uint8 sr, uint64 val) {
+	switch (sr) {
+		case SR_MMU_ROOT:
+			mmu.root = val;
+			mmu.flush();
+			mem->code_flush();
+			return;
+
+		case SR_TLB_FLUSH:
+			mmu.flush();
+			mem->code_flush();
+			return;
+
+		case SR_TLB_HITS:   mmu.stats.hits = val;   return;
+		case SR_TLB_MISSES: mmu.stats.misses = val; return;
+
+		case SR_IRQ_VECTOR: irq.vector = val; return;
+		case SR_IRQ_CAUSE:  irq.cause = val;  return;
+		case SR_IRQ_PC:     irq.pc = val;     return;
+
+		case SR_IRQ_MASK:
+			irq.mask = val;
+			irq.update();
+			return;
+
+		case SR_IRQ_ENABLE:
+			irq.enable = val != 0;
+			irq.update();
+			return;
+
+		case SR_IRQ_PENDING:
+			__atomic_fetch_and(&irq.pending, ~val, __ATOMIC_RELEASE);
+			return;
+
+		case SR_TIMER_INSNS:
+			irq.timer_insns = val;
+			irq.timer_left = val != 0 ? val : TIMER_OFF;
+			return;
+
+		case SR_TIMER_NS:
+			timers.set(this, val);
+			return;
+
+		case SR_DOORBELL:
+			__atomic_store_n(&irq.doorbell, val, __ATOMIC_RELEASE);
+			return;
+	}
+
+	fault(FAULT_ILLEGAL, insn->addr);
+}
 
-	if (i1 == 0x2e) { // pushr n
-		uint128 p1 = pop16(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 16;
 
-		LOG("pushi %016lx%016lx\n", p1>>64,p1);
+// a load or store at a physical address past RAM, by the device there
+void Core::io(uint64 addr, uint8 size, uint8 *data, bool write) {
+	BusRange *r = bus.find(addr, size);
 
-		regs[REG_SP].ul -= 16;
-		push(p1,regs[REG_SP].ul + regs[REG_LO].ul);
-	}
+	if (r == NULL)
+		fault(FAULT_BOUNDS, addr);
 
-	if (i1 == 0x2f) { // pushb
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+	if (write)
+		r->write(r->device, addr - r->start, size, data);
+	else
+		r->read(r->device, addr - r->start, size, data);
+}
 
-		LOG("pushb %%%d\n", p1);
 
-		regs[REG_SP].ul -= 1;
-		push(regs[p1].ub,regs[REG_SP].ul + regs[REG_LO].ul);
-	}
+// enters the handler of the lowest pending line with interrupts off,
+// between two instructions. Reading the vector does not fault, an entry
+// that can not be read stops the core on the interrupted instruction
+void Core::take_irq() {
+	uint64 lines = __atomic_load_n(&irq.pending, __ATOMIC_ACQUIRE) & irq.active;
+	uint8 line = __builtin_ctzl(lines);
 
-	if (i1 == 0x30) { // pushs
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+	uint64 addr = irq.vector + regs[REG_LO].ul + line * 8;
+	uint64 phys = addr;
+	uint8 code = FAULT_NONE;
 
-		LOG("pushs %%%d\n", p1);
+	if (addr & 7)
+		code = FAULT_ALIGN;
+	else if (mmu.root != 0 && !mmu.translate(mem, addr, MMU_READ, &phys))
+		code = FAULT_PAGE;
+	else if (!mem->contains(phys, 8))
+		code = FAULT_BOUNDS;
 
-		regs[REG_SP].ul -= 2;
-		push(regs[p1].us,regs[REG_SP].ul + regs[REG_LO].ul);
+	if (code != FAULT_NONE) {
+		fault_code = code;
+		fault_addr = addr;
+		set_flag(FLAG_RUNNING, 0);
+		return;
 	}
 
-	if (i1 == 0x31) { // pushi
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-
-		LOG("pushi %%%d\n", p1);
+	__atomic_fetch_and(&irq.pending, ~(1UL << line), __ATOMIC_RELAXED);
 
-		regs[REG_SP].ul -= 4;
-		push(regs[p1].ui,regs[REG_SP].ul + regs[REG_LO].ul);
-	}
+	if (lazy_flags)
+		materialize_flags();
 
-	if (i1 == 0x32) { // pushl
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+	irq.flags = flag & FLAGS_ALU;
+	irq.pc = regs[REG_PC].ul;
+	irq.cause = line;
+	irq.enable = false;
+	irq.update();
 
-		LOG("pushl %%%d\n", p1);
+	regs[REG_PC].ul = mem->load<uint64>(phys);
+}
 
-		regs[REG_SP].ul -= 8;
-		push(regs[p1].ul,regs[REG_SP].ul + regs[REG_LO].ul);
-	}
 
-	if (i1 == 0x33) { // pushr
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+// stops the core with PC back on the faulting instruction and unwinds to
+// the run() or step() that executed it
+void Core::fault(uint8 code, uint64 addr) {
+	fault_code = code;
+	fault_addr = addr;
 
-		LOG("pushr %%%d\n", p1);
+	regs[REG_PC].ul = insn->addr - regs[REG_LO].ul;
+	set_flag(FLAG_RUNNING, 0);
 
-		regs[REG_SP].ul -= 16;
-		push(regs[p1].ur,regs[REG_SP].ul + regs[REG_LO].ul);
-	}
+	siglongjmp(*fault_jmp, 1);
+}
 
-	if (i1 == 0x34) { // popb
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
 
-		LOG("popb %%%d\n", p1);
+// one kernel per operation, OP is a constant so only its case is kept.
+// The flags are left lazy: the operands are recorded and EQUALS, LESS and
+// MORE are only worked out once something asks for them.
+template<uint8 OP, class T> T Core::ALU(T a, T b) {
+	last_a = a;
+	last_b = b;
+	lazy_flags = true;
 
-		regs[p1].ub = pop1(regs[REG_SP].ul + regs[REG_LO].ul);
-		regs[REG_SP].ul += 1;
-	}
+	switch (OP) {
+		case ALU_SUM: return a + b;
+		case ALU_SUB: return a - b;
+		case ALU_MUL: return a * b;
 
-	if (i1 == 0x35) { // pops
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+		case ALU_DIV:
+			if (b == 0)
+				return 0;
 
-		LOG("pops %%%d\n", p1);
+			return a / b;
 
-		regs[p1].us = pop2(regs[REG_SP].ul + regs[REG_LO].ul);
-		regs[REG_SP].ul += 2;
-	}
+		case ALU_IDIV: {
+			T sign_bit = (T)1 << (sizeof(T) * 8 - 1);
+			T ia = a;
+			T ib = b;
 
-	if (i1 == 0x36) { // popi
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+			if (b == 0)
+				return 0;
 
-		LOG("popi %%%d\n", p1);
+			if ((a & sign_bit) == sign_bit)
+				ia = ~a + 1;
 
-		regs[p1].ui = pop4(regs[REG_SP].ul + regs[REG_LO].ul);
-		regs[REG_SP].ul += 4;
-	}
+			if ((b & sign_bit) == sign_bit)
+				ib = ~b + 1;
 
-	if (i1 == 0x37) { // popl
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+			T idiv = ia / ib;
 
-		LOG("popl %%%d\n", p1);
+			if (((a & sign_bit) == sign_bit) ^ ((b & sign_bit) == sign_bit))
+				idiv = ~(idiv - 1);
 
-		regs[p1].ul = pop8(regs[REG_SP].ul + regs[REG_LO].ul);
-		regs[REG_SP].ul += 8;
+			return idiv;
+		}
 	}
 
-	if (i1 == 0x38) { // popr
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-
-		LOG("popr %%%d\n", p1);
+	return 0;
+}
 
-		regs[p1].ur = pop16(regs[REG_SP].ul + regs[REG_LO].ul);
-		regs[REG_SP].ul += 16;
-	}
 
-	if (i1 == 0x39) { // sumb
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+#define OP_END  1 // ends a basic block
+#define OP_DEST 2 // writes %p1, ends a block too when that is PC or LO
+#define OP_BRANCH 4 // these three only feed Counters
+#define OP_CALL   8
+#define OP_RET    16
+
+// syntax is how the operands are disassembled: 1, 2, 3 stand for the
+// register operands, n for the immediate and a for an address
+struct OpInfo {
+	const char *name;
+	const char *syntax;
+	Handler handler;
+	uint8 regs; // register operands, one byte each
+	uint8 imm;  // bytes of immediate/address following them
+	uint8 flags;
+};
 
-		LOG("sumb %%%d %%%d %%%d\n", p1, p2, p3);
+static OpInfo ops[256];
 
-		regs[p1].ub = ALU(regs[p2].ub, regs[p3].ub, ALU_SUM);
-	}
 
-	if (i1 == 0x3a) { // sums
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+static void op_illegal(Core *c, Instruction *in) {
+	c->fault(FAULT_ILLEGAL, in->addr);
+}
 
-		LOG("sums %%%d %%%d %%%d\n", p1, p2, p3);
+static void op_fetch_fault(Core *c, Instruction *in) { // p1 is the fault code
+	c->fault(in->p1, in->addr);
+}
 
-		regs[p1].us = ALU(regs[p2].us, regs[p3].us, ALU_SUM);
-	}
+static void op_nop(Core *c, Instruction *in) {
+}
 
-	if (i1 == 0x3b) { // sumi
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+static void op_hlt(Core *c, Instruction *in) {
+	c->set_flag(FLAG_RUNNING, 0);
+}
 
-		LOG("sumi %%%d %%%d %%%d\n", p1, p2, p3);
+template<class T> static void op_mov_n(Core *c, Instruction *in) { // mov n
+	c->regs[in->p1].as<T>() = in->imm.as<T>();
+}
 
-		regs[p1].ui = ALU(regs[p2].ui, regs[p3].ui, ALU_SUM);
-	}
+template<class T> static void op_mov_r(Core *c, Instruction *in) { // mov r
+	c->regs[in->p1].as<T>() = c->regs[in->p2].as<T>();
+}
 
-	if (i1 == 0x3c) { // suml
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+template<class T> static void op_mov_from_ram(Core *c, Instruction *in) { // mov from RAM
+	c->regs[in->p1].as<T>() = c->pop<T>(in->imm.ul + c->regs[REG_LO].ul);
+}
 
-		LOG("suml %%%d %%%d %%%d\n", p1, p2, p3);
+template<class T> static void op_mov_to_ram(Core *c, Instruction *in) { // mov to RAM
+	c->push(c->regs[in->p1].as<T>(), in->imm.ul + c->regs[REG_LO].ul);
+}
 
-		regs[p1].ul = ALU(regs[p2].ul, regs[p3].ul, ALU_SUM);
-	}
+template<class T> static void op_mov_from_ramg(Core *c, Instruction *in) { // mov from RAMg
+	c->regs[in->p1].as<T>() = c->pop<T>(in->imm.ul);
+}
 
-	if (i1 == 0x3d) { // sumr
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+template<class T> static void op_mov_to_ramg(Core *c, Instruction *in) { // mov to RAMg
+	c->push(c->regs[in->p1].as<T>(), in->imm.ul);
+}
 
-		LOG("sumr %%%d %%%d %%%d\n", p1, p2, p3);
+template<class T> static void op_mov_from_ramr(Core *c, Instruction *in) { // mov from RAMr
+	c->regs[in->p1].as<T>() = c->pop<T>(c->regs[in->p2].ul + c->regs[REG_LO].ul);
+}
 
-		regs[p1].ur = ALU(regs[p2].ur, regs[p3].ur, ALU_SUM);
-	}
+template<class T> static void op_mov_to_ramr(Core *c, Instruction *in) { // mov to RAMr
+	c->push(c->regs[in->p1].as<T>(), c->regs[in->p2].ul + c->regs[REG_LO].ul);
+}
 
-	if (i1 == 0x3e) { // subb
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+// stores go before the SP update, so a faulting push leaves SP alone
+template<class T> static void op_push_n(Core *c, Instruction *in) { // push n
+	c->push(in->imm.as<T>(), c->regs[REG_SP].ul - sizeof(T) + c->regs[REG_LO].ul);
+	c->regs[REG_SP].ul -= sizeof(T);
+}
 
-		LOG("subb %%%d %%%d %%%d\n", p1, p2, p3);
+template<class T> static void op_push_r(Core *c, Instruction *in) { // push r
+	c->push(c->regs[in->p1].as<T>(), c->regs[REG_SP].ul - sizeof(T) + c->regs[REG_LO].ul);
+	c->regs[REG_SP].ul -= sizeof(T);
+}
 
-		regs[p1].ub = ALU(regs[p2].ub, regs[p3].ub, ALU_SUB);
-	}
+template<class T> static void op_pop_r(Core *c, Instruction *in) { // pop r
+	c->regs[in->p1].as<T>() = c->pop<T>(c->regs[REG_SP].ul + c->regs[REG_LO].ul);
+	c->regs[REG_SP].ul += sizeof(T);
+}
 
-	if (i1 == 0x3f) { // subs
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+template<class T, uint8 OP> static void op_alu(Core *c, Instruction *in) { // sum, sub, mul, div
+	c->regs[in->p1].as<T>() = c->ALU<OP>(c->regs[in->p2].as<T>(), c->regs[in->p3].as<T>());
+}
 
-		LOG("subs %%%d %%%d %%%d\n", p1, p2, p3);
+template<class T> static void op_cmp(Core *c, Instruction *in) { // cmp
+	c->ALU<ALU_SUB>(c->regs[in->p1].as<T>(), c->regs[in->p2].as<T>());
+}
 
-		regs[p1].us = ALU(regs[p2].us, regs[p3].us, ALU_SUB);
-	}
+template<uint8 COND> static void op_jump_n(Core *c, Instruction *in) { // jcc n
+	if (c->condition(COND))
+		c->regs[REG_PC].ul = in->imm.ul;
+}
 
-	if (i1 == 0x40) { // subi
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+template<uint8 COND> static void op_jump_r(Core *c, Instruction *in) { // jcc r
+	if (c->condition(COND))
+		c->regs[REG_PC].ul = c->regs[in->p1].ul;
+}
 
-		LOG("subi %%%d %%%d %%%d\n", p1, p2, p3);
+static void op_call_n(Core *c, Instruction *in) { // call
+	c->push(c->regs[REG_PC].ul, c->regs[REG_SP].ul - 8 + c->regs[REG_LO].ul);
+	c->regs[REG_SP].ul -= 8;
 
-		regs[p1].ui = ALU(regs[p2].ui, regs[p3].ui, ALU_SUB);
-	}
+	c->regs[REG_PC].ul = in->imm.ul;
+}
 
-	if (i1 == 0x41) { // subl
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+static void op_call_r(Core *c, Instruction *in) { // call r
+	c->push(c->regs[REG_PC].ul, c->regs[REG_SP].ul - 8 + c->regs[REG_LO].ul);
+	c->regs[REG_SP].ul -= 8;
 
-		LOG("subl %%%d %%%d %%%d\n", p1, p2, p3);
+	c->regs[REG_PC].ul = c->regs[in->p1].ul;
+}
 
-		regs[p1].ul = ALU(regs[p2].ul, regs[p3].ul, ALU_SUB);
-	}
+// EQUALS when the core started, not when it does not exist or already
+// runs, this one included
+static void op_start(Core *c, Instruction *in) { // start core
+	bool started = smp.start(c->regs[in->p1].ul, c->regs[in->p2].ul, c->regs[in->p3].ul, c->regs[REG_LO].ul);
 
-	if (i1 == 0x42) { // subr
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+	c->set_flag(FLAG_EQUALS, started);
+}
 
-		LOG("subr %%%d %%%d %%%d\n", p1, p2, p3);
+static void op_coreid(Core *c, Instruction *in) { // coreid
+	c->regs[in->p1].ul = c->id;
+}
 
-		regs[p1].ur = ALU(regs[p2].ur, regs[p3].ur, ALU_SUB);
-	}
+// sleeps until a line in the mask is posted, then goes on after wfi or
+// in the handler. With none in the mask nothing could wake it, that is hlt
+static void op_wfi(Core *c, Instruction *in) { // wfi
+	if (c->irq.woken())
+		return;
 
-	if (i1 == 0x43) { // mulb
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+	if (c->irq.mask != 0)
+		c->set_flag(FLAG_WAITING, 1);
 
-		LOG("mulb %%%d %%%d %%%d\n", p1,p2,p3);
+	c->set_flag(FLAG_RUNNING, 0);
+}
 
-		regs[p1].us = ALU(regs[p2].us, regs[p3].us, ALU_MUL);
-	}
+// the core [1] of this machine, this one outside of an Smp run
+static Core *ipi_target(Core *c, Instruction *in) {
+	uint8 id = c->regs[in->p1].ub;
+	Core *target = id == c->id ? c : smp.core(id);
 
-	if (i1 == 0x44) { // muls
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+	if (target == NULL || c->regs[in->p1].ul >= SMP_MAX)
+		c->fault(FAULT_ILLEGAL, in->addr);
 
-		LOG("muls %%%d %%%d %%%d\n", p1,p2,p3);
+	return target;
+}
 
-		regs[p1].ui = ALU(regs[p2].ui, regs[p3].ui, ALU_MUL);
-	}
+// Both post without a lock and wake the target if it waits. Interrupts
+// posted to an idle core are dropped when it is started.
+static void op_ipi(Core *c, Instruction *in) { // ipi, line [2] on core [1]
+	Core *target = ipi_target(c, in);
 
-	if (i1 == 0x45) { // muli
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+	if (c->regs[in->p2].ul >= IRQ_LINES)
+		c->fault(FAULT_ILLEGAL, in->addr);
 
-		LOG("muli %%%d %%%d %%%d\n", p1,p2,p3);
+	target->irq.post(c->regs[in->p2].ub);
+}
 
-		regs[p1].ul = ALU(regs[p2].ul, regs[p3].ul, ALU_MUL);
-	}
+static void op_ring(Core *c, Instruction *in) { // ring, doorbell bits [2] on core [1]
+	ipi_target(c, in)->irq.ring(c->regs[in->p2].ul);
+}
 
-	if (i1 == 0x46) { // mull
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+// the machine forks once every other core halted, see Forks. Only the
+// parent can: a child has no inputs of its own to hand out, and its
+// children could not be told from their uncles by SR_FORK_INDEX
+static void op_fork(Core *c, Instruction *in) {
+	if (forks.index != 0)
+		c->fault(FAULT_ILLEGAL, in->addr);
 
-		LOG("mull %%%d %%%d %%%d\n", p1,p2,p3);
+	c->set_flag(FLAG_FORK, 1);
+	c->set_flag(FLAG_RUNNING, 0);
+}
 
-		regs[p1].ur = ALU(regs[p2].ur, regs[p3].ur, ALU_MUL);
-	}
+// Memory model: plain movs, push and pop are not atomic, and other cores
+// may see them in any order the host allows. cas, xadd and xchg are atomic
+// on naturally aligned addresses [2] + LO and sequentially consistent.
+// They order every access around them, like fence does.
+template<class T> static T *atomic_ptr(Core *c, uint8 reg) {
+	uint64 addr = c->regs[reg].ul + c->regs[REG_LO].ul;
 
-	if (i1 == 0x47) { // mulr
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+	if (addr & (sizeof(T) - 1))
+		c->fault(FAULT_ALIGN, addr);
 
-		LOG("mulr %%%d %%%d %%%d\n", p1,p2,p3);
+	if (c->mmu.root != 0)
+		addr = c->translate(addr, MMU_WRITE);
 
-		regs[p1].ur = ALU(regs[p2].ur, regs[p3].ur, ALU_MUL);
-	}
+	// devices have no atomics
+	if (!c->mem->contains(addr, sizeof(T)))
+		c->fault(FAULT_BOUNDS, addr);
 
-	if (i1 == 0x48) { // imulb
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+	return (T*)(c->mem->base + addr);
+}
 
-		LOG("imulb %%%d %%%d %%%d\n", p1,p2,p3);
+template<class T> static void op_cas(Core *c, Instruction *in) { // cas, EQUALS when it swapped
+	T *p = atomic_ptr<T>(c, in->p2);
 
-		regs[p1].ub = ALU(regs[p2].ub, regs[p3].ub, ALU_MUL);
-	}
+	T expected = c->regs[in->p1].as<T>();
+	T old = expected;
 
-	if (i1 == 0x49) { // imuls
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+	__atomic_compare_exchange_n(p, &old, c->regs[in->p3].as<T>(), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
 
-		LOG("imuls %%%d %%%d %%%d\n", p1,p2,p3);
+	c->regs[in->p1].as<T>() = old;
+	c->ALU<ALU_SUB>(old, expected);
 
-		regs[p1].us = ALU(regs[p2].us, regs[p3].us, ALU_MUL);
-	}
+	c->mem->code_write((uint8*)p - c->mem->base, sizeof(T));
+}
 
-	if (i1 == 0x4a) { // imuli
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+template<class T> static void op_xadd(Core *c, Instruction *in) { // xadd
+	T *p = atomic_ptr<T>(c, in->p2);
 
-		LOG("imuli %%%d %%%d %%%d\n", p1,p2,p3);
+	c->regs[in->p1].as<T>() = __atomic_fetch_add(p, c->regs[in->p1].as<T>(), __ATOMIC_SEQ_CST);
 
-		regs[p1].ui = ALU(regs[p2].ui, regs[p3].ui, ALU_MUL);
-	}
+	c->mem->code_write((uint8*)p - c->mem->base, sizeof(T));
+}
 
-	if (i1 == 0x4b) { // imull
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+template<class T> static void op_xchg(Core *c, Instruction *in) { // xchg
+	T *p = atomic_ptr<T>(c, in->p2);
 
-		LOG("imull %%%d %%%d %%%d\n", p1,p2,p3);
+	c->regs[in->p1].as<T>() = __atomic_exchange_n(p, c->regs[in->p1].as<T>(), __ATOMIC_SEQ_CST);
 
-		regs[p1].ul = ALU(regs[p2].ul, regs[p3].ul, ALU_MUL);
-	}
+	c->mem->code_write((uint8*)p - c->mem->base, sizeof(T));
+}
 
-	if (i1 == 0x4c) { // imulr
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+static void op_fence(Core *c, Instruction *in) { // fence
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
 
-		LOG("imulr %%%d %%%d %%%d\n", p1,p2,p3);
+static void op_mfsr(Core *c, Instruction *in) { // mfsr
+	c->regs[in->p1].ul = c->read_sr(in->imm.ub);
+}
 
-		regs[p1].ur = ALU(regs[p2].ur, regs[p3].ur, ALU_MUL);
-	}
+static void op_mtsr(Core *c, Instruction *in) { // mtsr
+	c->write_sr(in->imm.ub, c->regs[in->p1].ul);
+}
 
-	if (i1 == 0x4d) { // divb
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+static void op_iret(Core *c, Instruction *in) { // iret, back from a handler
+	c->regs[REG_PC].ul = c->irq.pc;
+	c->flag = (c->flag & ~FLAGS_ALU) | (c->irq.flags & FLAGS_ALU);
+	c->lazy_flags = false;
 
-		LOG("divb %%%d %%%d %%%d\n", p1,p2,p3);
+	c->irq.enable = true;
+	c->irq.update();
+}
 
-		regs[p1].ub = ALU(regs[p2].ub, regs[p3].ub, ALU_DIV);
-	}
+static void op_ret(Core *c, Instruction *in) { // ret
+	c->regs[REG_PC].ul = c->pop8(c->regs[REG_SP].ul + c->regs[REG_LO].ul);
+	c->regs[REG_SP].ul += 8;
+}
 
-	if (i1 == 0x4e) { // divs
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
 
-		LOG("divs %%%d %%%d %%%d\n", p1,p2,p3);
+static void set_op(uint8 op, const char *name, const char *syntax, Handler handler, uint8 regs, uint8 imm, uint8 flags) {
+	ops[op].name = name;
+	ops[op].syntax = syntax;
+	ops[op].handler = handler;
+	ops[op].regs = regs;
+	ops[op].imm = imm;
+	ops[op].flags = flags;
+}
 
-		regs[p1].us = ALU(regs[p2].us, regs[p3].us, ALU_DIV);
-	}
+// registers the five width variants b, s, i, l, r of one instruction,
+// an immediate of IMM_W bytes is as wide as the variant itself
+#define IMM_W 0xff
+
+#define SET_OPS(op, name, syntax, handler, regs, imm, flags) \
+	set_op(op + 0, name "b", syntax, handler<uint8>,   regs, imm == IMM_W ?  1 : imm, flags); \
+	set_op(op + 1, name "s", syntax, handler<uint16>,  regs, imm == IMM_W ?  2 : imm, flags); \
+	set_op(op + 2, name "i", syntax, handler<uint32>,  regs, imm == IMM_W ?  4 : imm, flags); \
+	set_op(op + 3, name "l", syntax, handler<uint64>,  regs, imm == IMM_W ?  8 : imm, flags); \
+	set_op(op + 4, name "r", syntax, handler<uint128>, regs, imm == IMM_W ? 16 : imm, flags);
+
+#define SET_ALU_OPS(op, name, alu) \
+	set_op(op + 0, name "b", "1 2 3", op_alu<uint8,   alu>, 3, 0, OP_DEST); \
+	set_op(op + 1, name "s", "1 2 3", op_alu<uint16,  alu>, 3, 0, OP_DEST); \
+	set_op(op + 2, name "i", "1 2 3", op_alu<uint32,  alu>, 3, 0, OP_DEST); \
+	set_op(op + 3, name "l", "1 2 3", op_alu<uint64,  alu>, 3, 0, OP_DEST); \
+	set_op(op + 4, name "r", "1 2 3", op_alu<uint128, alu>, 3, 0, OP_DEST);
+
+// atomics come in b, s, i and l only
+#define SET_ATOMIC_OPS(op, name, syntax, handler, regs) \
+	set_op(op + 0, name "b", syntax, handler<uint8>,  regs, 0, OP_DEST); \
+	set_op(op + 1, name "s", syntax, handler<uint16>, regs, 0, OP_DEST); \
+	set_op(op + 2, name "i", syntax, handler<uint32>, regs, 0, OP_DEST); \
+	set_op(op + 3, name "l", syntax, handler<uint64>, regs, 0, OP_DEST);
+
+static bool init_ops() {
+	for (int i = 0; i < 256; i++)
+		set_op(i, "illegal", "", op_illegal, 0, 0, OP_END);
+
+	set_op(0x00, "nop", "", op_nop, 0, 0, 0);
+	set_op(0x01, "hlt", "", op_hlt, 0, 0, OP_END);
+
+	SET_OPS(0x02, "mov",  "1 n",   op_mov_n,         1, IMM_W, OP_DEST)
+	SET_OPS(0x07, "mov",  "1 2",   op_mov_r,         2, 0,     OP_DEST)
+	SET_OPS(0x0c, "mov",  "1 [a]", op_mov_from_ram,  1, 8,     OP_DEST)
+	SET_OPS(0x11, "mov",  "[a] 1", op_mov_to_ram,    1, 8,     0)
+	SET_OPS(0x16, "mov",  "1 {a}", op_mov_from_ramg, 1, 8,     OP_DEST)
+	SET_OPS(0x1b, "mov",  "{a} 1", op_mov_to_ramg,   1, 8,     0)
+	SET_OPS(0x20, "mov",  "1 [2]", op_mov_from_ramr, 2, 0,     OP_DEST)
+	SET_OPS(0x25, "mov",  "[2] 1", op_mov_to_ramr,   2, 0,     0)
+	SET_OPS(0x2a, "push", "n",     op_push_n,        0, IMM_W, 0)
+	SET_OPS(0x2f, "push", "1",     op_push_r,        1, 0,     0)
+	SET_OPS(0x34, "pop",  "1",     op_pop_r,         1, 0,     OP_DEST)
+	SET_ALU_OPS(0x39, "sum",  ALU_SUM)
+	SET_ALU_OPS(0x3e, "sub",  ALU_SUB)
+	SET_ALU_OPS(0x48, "imul", ALU_MUL)
+	SET_ALU_OPS(0x4d, "div",  ALU_DIV)
+	SET_ALU_OPS(0x52, "idiv", ALU_IDIV)
+	SET_OPS(0x57, "cmp",  "1 2",   op_cmp,           2, 0,     0)
+
+	// mul widens the result, so each variant works one size up
+	set_op(0x43, "mulb", "1 2 3", op_alu<uint16,  ALU_MUL>, 3, 0, OP_DEST);
+	set_op(0x44, "muls", "1 2 3", op_alu<uint32,  ALU_MUL>, 3, 0, OP_DEST);
+	set_op(0x45, "muli", "1 2 3", op_alu<uint64,  ALU_MUL>, 3, 0, OP_DEST);
+	set_op(0x46, "mull", "1 2 3", op_alu<uint128, ALU_MUL>, 3, 0, OP_DEST);
+	set_op(0x47, "mulr", "1 2 3", op_alu<uint128, ALU_MUL>, 3, 0, OP_DEST);
+
+	set_op(0x5c, "je",  "a", op_jump_n<COND_E>,  0, 8, OP_END | OP_BRANCH);
+	set_op(0x5d, "jne", "a", op_jump_n<COND_NE>, 0, 8, OP_END | OP_BRANCH);
+	set_op(0x5e, "jb",  "a", op_jump_n<COND_B>,  0, 8, OP_END | OP_BRANCH);
+	set_op(0x5f, "jbe", "a", op_jump_n<COND_BE>, 0, 8, OP_END | OP_BRANCH);
+	set_op(0x60, "jl",  "a", op_jump_n<COND_L>,  0, 8, OP_END | OP_BRANCH);
+	set_op(0x61, "jle", "a", op_jump_n<COND_LE>, 0, 8, OP_END | OP_BRANCH);
+	set_op(0x62, "je",  "1", op_jump_r<COND_E>,  1, 0, OP_END | OP_BRANCH);
+	set_op(0x63, "jne", "1", op_jump_r<COND_NE>, 1, 0, OP_END | OP_BRANCH);
+	set_op(0x64, "jb",  "1", op_jump_r<COND_B>,  1, 0, OP_END | OP_BRANCH);
+	set_op(0x65, "jbe", "1", op_jump_r<COND_BE>, 1, 0, OP_END | OP_BRANCH);
+	set_op(0x66, "jl",  "1", op_jump_r<COND_L>,  1, 0, OP_END | OP_BRANCH);
+	set_op(0x67, "jle", "1", op_jump_r<COND_LE>, 1, 0, OP_END | OP_BRANCH);
+
+	set_op(0x68, "call", "a", op_call_n, 0, 8, OP_END | OP_CALL);
+	set_op(0x69, "call", "1", op_call_r, 1, 0, OP_END | OP_CALL);
+	set_op(0x6a, "ret",  "",  op_ret,    0, 0, OP_END | OP_RET);
+
+	set_op(0x6b, "start",  "1 2 3", op_start,  3, 0, 0);
+	set_op(0x6c, "coreid", "1",     op_coreid, 1, 0, OP_DEST);
+
+	SET_ATOMIC_OPS(0x6d, "cas",  "1 [2] 3", op_cas,  3)
+	SET_ATOMIC_OPS(0x71, "xadd", "1 [2]",   op_xadd, 2)
+	SET_ATOMIC_OPS(0x75, "xchg", "1 [2]",   op_xchg, 2)
+	set_op(0x79, "fence", "", op_fence, 0, 0, 0);
+
+	// mtsr can change how code is fetched, so it ends the block
+	set_op(0x7a, "mfsr", "1 n", op_mfsr, 1, 1, OP_DEST);
+	set_op(0x7b, "mtsr", "n 1", op_mtsr, 1, 1, OP_END);
+
+	set_op(0x7c, "fork", "", op_fork, 0, 0, OP_END);
+
+	set_op(0x7d, "iret", "", op_iret, 0, 0, OP_END);
+	set_op(0x7e, "wfi", "", op_wfi, 0, 0, OP_END);
+
+	set_op(0x7f, "ipi",  "1 2", op_ipi,  2, 0, 0);
+	set_op(0x80, "ring", "1 2", op_ring, 2, 0, 0);
+
+	return true;
+}
 
-	if (i1 == 0x4f) { // divi
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+static bool ops_ready = init_ops();
 
-		LOG("divi %%%d %%%d %%%d\n", p1,p2,p3);
 
-		regs[p1].ui = ALU(regs[p2].ui, regs[p3].ui, ALU_DIV);
-	}
+// by the opcode layout: movs between RAM and registers in groups of five
+// widths, pushes, pops, call and ret, and the atomics in groups of four
+void op_memory(uint8 op, uint8 *read, uint8 *write) {
+	static const uint8 widths[5] = {1, 2, 4, 8, 16};
 
-	if (i1 == 0x50) { // divl
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+	*read = 0;
+	*write = 0;
 
-		LOG("divl %%%d %%%d %%%d\n", p1,p2,p3);
+	if (op >= 0x0c && op <= 0x29) {
+		uint8 kind = (op - 0x0c) / 5;
 
-		regs[p1].ul = ALU(regs[p2].ul, regs[p3].ul, ALU_DIV);
+		if (kind & 1)
+			*write = widths[(op - 0x0c) % 5];
+		else
+			*read = widths[(op - 0x0c) % 5];
+	} else if (op >= 0x2a && op <= 0x33) {
+		*write = widths[(op - 0x2a) % 5];
+	} else if (op >= 0x34 && op <= 0x38) {
+		*read = widths[op - 0x34];
+	} else if (op == 0x68 || op == 0x69) {
+		*write = 8;
+	} else if (op == 0x6a) {
+		*read = 8;
+	} else if (op >= 0x6d && op <= 0x78) {
+		*read = *write = widths[(op - 0x6d) % 4];
 	}
+}
 
-	if (i1 == 0x51) { // divr
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
 
-		LOG("divr %%%d %%%d %%%d\n", p1,p2,p3);
+// copies up to INSN_MAX bytes of code at addr, stopping at the first one
+// that can not be fetched, and returns how many it got. code tells why
+// it stopped short, phys where each byte came from.
+uint64 Core::fetch(uint64 addr, uint8 *bytes, uint64 *phys, uint8 *code) {
+	uint64 page = 0;
+	uint64 n = INSN_MAX;
 
-		regs[p1].ur = ALU(regs[p2].ur, regs[p3].ur, ALU_DIV);
-	}
+	for (uint64 i = 0; i < INSN_MAX; i++) {
+		uint64 a = addr + i;
 
-	if (i1 == 0x52) { // idivb
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+		if (mmu.root == 0) {
+			if (!mem->contains(a)) {
+				*code = FAULT_FETCH;
+				n = i;
+				break;
+			}
 
-		LOG("idivb %%%d %%%d %%%d\n", p1,p2,p3);
+			phys[i] = a;
+		} else {
+			if ((i == 0 || (a & PAGE_MASK) == 0) && !mmu.translate(mem, a & ~PAGE_MASK, MMU_EXEC, &page)) {
+				*code = FAULT_PAGE;
+				n = i;
+				break;
+			}
 
-		regs[p1].ub = ALU(regs[p2].ub, regs[p3].ub, ALU_IDIV);
+			phys[i] = page | (a & PAGE_MASK);
+		}
 	}
 
-	if (i1 == 0x53) { // idivs
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+	if (n == 0)
+		return 0;
 
-		LOG("idivs %%%d %%%d %%%d\n", p1,p2,p3);
+	// the lines are marked before the bytes are read, so a store from
+	// another core either sees the mark and invalidates, or lands before
+	// the read. Under 64 bytes, the first and the last byte cover them all
+	mem->code_mark(phys[0], 1);
+	mem->code_mark(phys[n - 1], 1);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
 
-		regs[p1].us = ALU(regs[p2].us, regs[p3].us, ALU_IDIV);
-	}
+	for (uint64 i = 0; i < n; i++)
+		bytes[i] = mem->base[phys[i]];
 
-	if (i1 == 0x54) { // idivi
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+	return n;
+}
 
-		LOG("idivi %%%d %%%d %%%d\n", p1,p2,p3);
+void Core::reset_decoded() {
+	decoded_lo = ~0UL;
+	decoded_hi = 0;
+}
 
-		regs[p1].ui = ALU(regs[p2].ui, regs[p3].ui, ALU_IDIV);
-	}
+void Core::decode(uint64 addr, Instruction *in) {
+	uint8 bytes[INSN_MAX];
+	uint64 phys[INSN_MAX];
+	uint8 code = FAULT_NONE;
+	uint64 n = fetch(addr, bytes, phys, &code);
 
-	if (i1 == 0x55) { // idivl
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+	in->addr = addr;
 
-		LOG("idivl %%%d %%%d %%%d\n", p1,p2,p3);
+	// an instruction that can not be fetched whole faults once it executes
+	if (n == 0 || n < 1 + ops[bytes[0]].regs + ops[bytes[0]].imm) {
+		in->handler = op_fetch_fault;
+		in->op = 0;
+		in->p1 = code;
+		in->p2 = in->p3 = 0;
+		in->size = 1;
+		in->flags = INSN_END | INSN_ILLEGAL;
+		in->imm.ur = 0;
 
-		regs[p1].ul = ALU(regs[p2].ul, regs[p3].ul, ALU_IDIV);
+		// the fault depends on what is not there, which RAM can not show
+		decoded_lo = 0;
+		decoded_hi = ~0UL;
+		return;
 	}
 
-	if (i1 == 0x56) { // idivr
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p3 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-
-		LOG("idivr %%%d %%%d %%%d\n", p1,p2,p3);
-
-		regs[p1].ur = ALU(regs[p2].ur, regs[p3].ur, ALU_IDIV);
-	}
+	OpInfo *info = &ops[bytes[0]];
+	uint8 *p = &in->p1;
 
-	if (i1 == 0x57) { // cmpb
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+	in->op = bytes[0];
+	in->handler = info->handler;
+	in->p1 = in->p2 = in->p3 = 0;
+	in->size = 1 + info->regs + info->imm;
+	in->imm.ur = 0;
 
-		LOG("cmpb %%%d %%%d\n", p1,p2);
+	for (int i = 0; i < info->regs; i++) {
+		p[i] = bytes[1 + i];
 
-		ALU(regs[p1].ub, regs[p2].ub, ALU_SUB);
+		if (p[i] >= REGISTERS_COUNT)
+			in->handler = op_illegal;
 	}
 
-	if (i1 == 0x58) { // cmps
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+	memcpy(&in->imm, bytes + 1 + info->regs, info->imm);
 
-		LOG("cmps %%%d %%%d\n", p1,p2);
+	if (in->handler == op_illegal)
+		in->size = 1;
 
-		ALU(regs[p1].us, regs[p2].us, ALU_SUB);
-	}
+	in->flags = 0;
 
-	if (i1 == 0x59) { // cmpi
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+	if (in->handler == op_illegal)
+		in->flags |= INSN_END | INSN_ILLEGAL;
 
-		LOG("cmpi %%%d %%%d\n", p1,p2);
+	if (info->flags & OP_END)
+		in->flags |= INSN_END;
 
-		ALU(regs[p1].ui, regs[p2].ui, ALU_SUB);
-	}
+	if (info->flags & OP_BRANCH)
+		in->flags |= INSN_BRANCH;
 
-	if (i1 == 0x5a) { // cmpl
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+	if (info->flags & OP_CALL)
+		in->flags |= INSN_CALL;
 
-		LOG("cmpl %%%d %%%d\n", p1,p2);
+	if (info->flags & OP_RET)
+		in->flags |= INSN_RET;
 
-		ALU(regs[p1].ul, regs[p2].ul, ALU_SUB);
-	}
+	if ((info->flags & OP_DEST) && (in->p1 == REG_PC || in->p1 == REG_LO))
+		in->flags |= INSN_END;
 
-	if (i1 == 0x5b) { // cmpr
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-		uint8 p2 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+	if (phys[0] < decoded_lo)
+		decoded_lo = phys[0];
 
-		LOG("cmpr %%%d %%%d\n", p1,p2);
+	if (phys[in->size - 1] + 1 > decoded_hi)
+		decoded_hi = phys[in->size - 1] + 1;
+}
 
-		ALU(regs[p1].ur, regs[p2].ur, ALU_SUB);
-	}
 
-	if (i1 == 0x5c) { // je
-		uint64 addr = pop8(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 8;
+static void trace_insn(Core *c, uint64 pc, Instruction *in) {
+	OpInfo *info = &ops[in->op];
+	uint8 *p = &in->p1;
+	char text[128];
+	int n = 0;
 
-		LOG("je %16lx\n", addr);
+	if (trace.level >= TRACE_REGS)
+		c->print_info();
 
-		if ((flag & FLAG_EQUALS) == FLAG_EQUALS)
-			regs[REG_PC].ul = addr;
+	if (in->handler == op_fetch_fault) {
+		trace.write("%x %016lx  %s\n", c->id, pc, fault_names[in->p1]);
+		return;
 	}
 
-	if (i1 == 0x5d) { // jne
-		uint64 addr = pop8(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 8;
-
-		LOG("jne %16lx\n", addr);
-
-		if ((flag & FLAG_EQUALS) != FLAG_EQUALS)
-			regs[REG_PC].ul = addr;
+	if (in->flags & INSN_ILLEGAL) {
+		trace.write("%x %016lx  illegal %02x\n", c->id, pc, in->op);
+		return;
 	}
 
-	if (i1 == 0x5e) { // jb
-		uint64 addr = pop8(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 8;
+	text[0] = 0;
 
-		LOG("jb %16lx\n", addr);
-
-		if ((flag & FLAG_MORE) == FLAG_MORE)
-			regs[REG_PC].ul = addr;
+	for (const char *s = info->syntax; *s != 0; s++) {
+		if (*s >= '1' && *s <= '3')
+			n += sprintf(text + n, "%%%d", p[*s - '1']);
+		else if (*s == 'a')
+			n += sprintf(text + n, "%016lx", in->imm.ul);
+		else if (*s == 'n' && info->imm == 16)
+			n += sprintf(text + n, "%016lx%016lx", (uint64)(in->imm.ur >> 64), in->imm.ul);
+		else if (*s == 'n')
+			n += sprintf(text + n, "%0*lx", info->imm * 2, in->imm.ul);
+		else
+			text[n++] = *s, text[n] = 0;
 	}
 
-	if (i1 == 0x5f) { // jbe
-		uint64 addr = pop8(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 8;
-
-		LOG("jbe %16lx\n", addr);
-
-		if ((flag & FLAG_MORE) != FLAG_MORE || (flag & FLAG_EQUALS) == FLAG_EQUALS)
-			regs[REG_PC].ul = addr;
-	}
+	trace.write("%x %016lx  %-5s %s\n", c->id, pc, info->name, text);
+}
 
-	if (i1 == 0x60) { // jl
-		uint64 addr = pop8(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 8;
 
-		LOG("jl %16lx\n", addr);
+// the traced variant only differs by the trace_insn() call, which the
+// plain one does not contain at all
+template<bool TRACE> void Core::step_as() {
+	if (irq.ready()) {
+		take_irq();
 
-		if ((flag & FLAG_LESS) == FLAG_LESS)
-			regs[REG_PC].ul = addr;
+		if (!get_flag(FLAG_RUNNING))
+			return;
 	}
 
-	if (i1 == 0x61) { // jle
-		uint64 addr = pop8(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 8;
+	uint64 addr = regs[REG_PC].ul + regs[REG_LO].ul;
 
-		LOG("jle %16lx\n", addr);
+	if (icache.epoch != mem->code_epoch_now())
+		icache.flush();
 
-		if ((flag & FLAG_LESS) == FLAG_LESS || (flag & FLAG_EQUALS) == FLAG_EQUALS)
-			regs[REG_PC].ul = addr;
-	}
+	Instruction *in = icache.slot(addr);
 
-	if (i1 == 0x62) { // je r
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+	if (in->addr != addr)
+		decode(addr, in);
 
-		LOG("je %%%d\n", p1);
+	if (TRACE)
+		trace_insn(this, regs[REG_PC].ul, in);
 
-		if ((flag & FLAG_EQUALS) == FLAG_EQUALS)
-			regs[REG_PC].ul = regs[p1].ul;
-	}
-
-	if (i1 == 0x63) { // jne r
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+	regs[REG_PC].ul += in->size;
 
-		LOG("jne %%%d\n", p1);
+	insn = in;
+	in->handler(this, in);
 
-		if ((flag & FLAG_EQUALS) != FLAG_EQUALS)
-			regs[REG_PC].ul = regs[p1].ul;
-	}
+	counters.ops[in->op]++;
+	count_exit(in);
 
-	if (i1 == 0x64) { // jb r
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-
-		LOG("jb %%%d\n", p1);
+	irq.tick(1);
+}
 
-		if ((flag & FLAG_MORE) == FLAG_MORE)
-			regs[REG_PC].ul = regs[p1].ul;
-	}
+// step() and run() are where faults unwind to, they keep the outer
+// target so that run() can fall back to step()
+void Core::step() {
+	sigjmp_buf buf;
+	sigjmp_buf *outer = fault_jmp;
 
-	if (i1 == 0x65) { // jbe r
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+	fault_jmp = &buf;
+	current_core = this;
 
-		LOG("jbe %%%d\n", p1);
+	if (sigsetjmp(buf, 0) == 0)
+		step_as<false>();
 
-		if ((flag & FLAG_MORE) == FLAG_MORE || (flag & FLAG_EQUALS) == FLAG_EQUALS)
-			regs[REG_PC].ul = regs[p1].ul;
-	}
+	fault_jmp = outer;
+}
 
-	if (i1 == 0x66) { // jl r
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+void Core::trace_step() {
+	sigjmp_buf buf;
+	sigjmp_buf *outer = fault_jmp;
 
-		LOG("jl %%%d\n", p1);
+	fault_jmp = &buf;
+	current_core = this;
 
-		if ((flag & FLAG_LESS) == FLAG_LESS)
-			regs[REG_PC].ul = regs[p1].ul;
-	}
+	if (sigsetjmp(buf, 0) == 0)
+		step_as<true>();
 
-	if (i1 == 0x67) { // jle r
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
+	fault_jmp = outer;
+}
 
-		LOG("jle %%%d\n", p1);
 
-		if ((flag & FLAG_LESS) == FLAG_LESS || (flag & FLAG_EQUALS) == FLAG_EQUALS)
-			regs[REG_PC].ul = regs[p1].ul;
-	}
+// executes up to budget instructions a whole basic block at a time and
+// returns how many retired. Blocks that do not fit the remaining budget
+// are finished with step(). Guest stores into a running block take
+// effect from the next block on.
+uint64 Core::run(uint64 budget) {
+	volatile uint64 done = 0;
+	sigjmp_buf buf;
+	sigjmp_buf *outer = fault_jmp;
 
-	if (i1 == 0x68) { // call
-		uint64 addr = pop8(regs[REG_PC].ul + regs[REG_LO].ul);
-		regs[REG_PC].ul += 8;
+	fault_jmp = &buf;
+	current_core = this;
 
-		LOG("call %16lx\n", addr);
+	if (sigsetjmp(buf, 0) == 0) {
+		run_blocks(budget, &done);
+	} else if (block != NULL) {
+		// what ran before the fault retired, the faulting one too as in
+		// step(), though its opcode is not counted there either
+		uint32 ran = insn - block->insns;
 
-		regs[REG_SP].ul -= 8;
-		push(regs[REG_PC].ul, regs[REG_SP].ul + regs[REG_LO].ul);
+		for (uint32 i = 0; i < ran; i++)
+			bcache.op_counts[block->insns[i].op]++;
 
-		regs[REG_PC].ul = addr;
+		irq.tick(ran);
+		done += ran + 1;
+		block = NULL;
 	}
 
-	if (i1 == 0x69) { // call r
-		uint8 p1 = ram[regs[REG_PC].ul++ + regs[REG_LO].ul];
-
-		LOG("call %%%d\n", p1);
+	fault_jmp = outer;
 
-		regs[REG_SP].ul -= 8;
-		push(regs[REG_PC].ul, regs[REG_SP].ul + regs[REG_LO].ul);
+	// so readers see the opcodes from at most one slice ago
+	bcache.fold();
 
-		regs[REG_PC].ul = regs[p1].ul;
-	}
-
-	if (i1 == 0x6a) { // ret
-		LOG("ret\n");
+	return done;
+}
 
-		regs[REG_PC].ul = pop8(regs[REG_SP].ul + regs[REG_LO].ul);
-		regs[REG_SP].ul += 8;
+void Core::run_blocks(uint64 budget, volatile uint64 *retired) {
+	uint64 done = 0;
+	Block *prev = NULL;
+
+	while (done < budget && get_flag(FLAG_RUNNING)) {
+		// checked once per block, blocks end on mtsr and iret
+		if (irq.ready()) {
+			take_irq();
+			prev = NULL;
+			continue;
+		}
+
+		if (bcache.epoch != mem->code_epoch_now()) {
+			bcache.flush();
+			jit.flush();
+			prev = NULL;
+		}
+
+		uint64 addr = regs[REG_PC].ul + regs[REG_LO].ul;
+		Block *b = NULL;
+
+		if (prev != NULL) {
+			if (prev->next[0] != NULL && prev->next[0]->addr == addr)
+				b = prev->next[0];
+			else if (prev->next[1] != NULL && prev->next[1]->addr == addr)
+				b = prev->next[1];
+		}
+
+		if (b != NULL) {
+			bcache.stats.chained++;
+		} else {
+			b = bcache.lookup(addr);
+
+			if (b != NULL) {
+				bcache.stats.hits++;
+			} else {
+				b = bcache.build(this, addr);
+
+				if (b == NULL) {
+					jit.flush();
+					prev = NULL;
+					continue;
+				}
+			}
+
+			if (prev != NULL)
+				bcache.link(prev, b);
+		}
+
+		if (b->count > budget - done) {
+			step();
+			done++;
+			*retired = done;
+			prev = NULL;
+			continue;
+		}
+
+		if (use_jit && b->code == NULL && ++b->execs == JIT_THRESHOLD) {
+			b->code = jit.compile(b);
+
+			if (b->code == NULL) {
+				bcache.flush();
+				jit.flush();
+				prev = NULL;
+				continue;
+			}
+		}
+
+		block = b;
+
+		if (b->code != NULL) {
+			b->code(this);
+			jit.stats.runs++;
+		} else {
+			for (uint32 i = 0; i < b->count; i++) {
+				Instruction *in = &b->insns[i];
+
+				regs[REG_PC].ul += in->size;
+
+				insn = in;
+				in->handler(this, in);
+			}
+		}
+
+		block = NULL;
+		done += b->count;
+		*retired = done;
+		prev = b;
+
+		bcache.ran(b);
+		count_exit(&b->insns[b->count - 1]);
+
+		irq.tick(b->count);
 	}
 }
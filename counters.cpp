@@ -0,0 +1,158 @@
+#include <counters.h>
+#include <core.h>
+
+#include <thread>
+
+#include <string.h>
+#include <signal.h>
+
+
+static const char *counters_name;
+static Core *counters_cores;
+static uint8 counters_count;
+
+
+void Counters::clear() {
+	memset(this, 0, sizeof(*this));
+}
+
+
+static void write_core(FILE *f, Counters *c, uint64 *ops, TlbStats *tlb, BlockStats *blocks, JitStats *jit) {
+	uint64 retired = 0;
+	uint64 read_bytes = 0;
+	uint64 write_bytes = 0;
+
+	for (int i = 0; i < 256; i++) {
+		uint8 read, write;
+		op_memory(i, &read, &write);
+
+		retired += ops[i];
+		read_bytes += ops[i] * read;
+		write_bytes += ops[i] * write;
+	}
+
+	fprintf(f, "\"retired\": %lu, \"read_bytes\": %lu, \"write_bytes\": %lu, ",
+			retired, read_bytes, write_bytes);
+	fprintf(f, "\"call_depth\": %ld, \"max_call_depth\": %ld, ", c->depth, c->max_depth);
+	fprintf(f, "\"tlb\": {\"hits\": %lu, \"misses\": %lu},\n", tlb->hits, tlb->misses);
+	fprintf(f, "\t\t\"blocks\": {\"hits\": %lu, \"chained\": %lu, \"misses\": %lu, \"invalidations\": %lu}, ",
+			blocks->hits, blocks->chained, blocks->misses, blocks->invalidations);
+	fprintf(f, "\"jit\": {\"compiled\": %lu, \"runs\": %lu},\n", jit->compiled, jit->runs);
+
+	fprintf(f, "\t\t\"branches\": {");
+
+	for (int i = 0; i < COUNTERS_BRANCHES; i++)
+		fprintf(f, "%s\"0x%02x\": [%lu, %lu]", i == 0 ? "" : ", ",
+				COUNTERS_BRANCH_FIRST + i, c->taken[i], c->not_taken[i]);
+
+	fprintf(f, "},\n\t\t\"ops\": {");
+
+	bool first = true;
+
+	for (int i = 0; i < 256; i++) {
+		if (ops[i] == 0)
+			continue;
+
+		fprintf(f, "%s\"0x%02x\": %lu", first ? "" : ", ", i, ops[i]);
+		first = false;
+	}
+
+	fprintf(f, "}");
+}
+
+// branches are [taken, not taken], ops only those that ran. The sum is
+// read field by field from cores still running, so it is not exact then
+void counters_write(FILE *f, Core *cores, uint8 count) {
+	Counters total;
+	uint64 total_ops[256];
+	TlbStats total_tlb = {0, 0};
+	BlockStats total_blocks = {0, 0, 0, 0};
+	JitStats total_jit = {0, 0};
+
+	total.clear();
+	memset(total_ops, 0, sizeof(total_ops));
+
+	fprintf(f, "{\"cores\": [\n");
+
+	for (int i = 0; i < count; i++) {
+		Core *core = &cores[i];
+		Counters *c = &core->counters;
+		uint64 ops[256];
+
+		for (int k = 0; k < 256; k++) {
+			ops[k] = c->ops[k] + core->bcache.op_counts[k];
+			total_ops[k] += ops[k];
+		}
+
+		for (int k = 0; k < COUNTERS_BRANCHES; k++) {
+			total.taken[k] += c->taken[k];
+			total.not_taken[k] += c->not_taken[k];
+		}
+
+		total.depth += c->depth;
+
+		if (c->max_depth > total.max_depth)
+			total.max_depth = c->max_depth;
+
+		total_tlb.hits += core->mmu.stats.hits;
+		total_tlb.misses += core->mmu.stats.misses;
+
+		total_blocks.hits += core->bcache.stats.hits;
+		total_blocks.chained += core->bcache.stats.chained;
+		total_blocks.misses += core->bcache.stats.misses;
+		total_blocks.invalidations += core->bcache.stats.invalidations;
+		total_jit.compiled += core->jit.stats.compiled;
+		total_jit.runs += core->jit.stats.runs;
+
+		fprintf(f, "\t{\"id\": %d, ", i);
+		write_core(f, c, ops, &core->mmu.stats, &core->bcache.stats, &core->jit.stats);
+		fprintf(f, "}%s\n", i + 1 == count ? "" : ",");
+	}
+
+	fprintf(f, "],\n\"total\": {");
+	write_core(f, &total, total_ops, &total_tlb, &total_blocks, &total_jit);
+	fprintf(f, "}}\n");
+}
+
+static void write_named() {
+	FILE *f = counters_name != NULL ? fopen(counters_name, "w") : stderr;
+
+	if (f == NULL)
+		return;
+
+	counters_write(f, counters_cores, counters_count);
+
+	if (f != stderr)
+		fclose(f);
+	else
+		fflush(f);
+}
+
+
+// SIGUSR1 is blocked here, before any core thread exists, so they inherit
+// that and only this thread takes it, out of signal context. The host
+// timer thread may be older, it blocks it itself
+static void reporter(sigset_t set) {
+	int sig;
+
+	while (sigwait(&set, &sig) == 0)
+		write_named();
+}
+
+void counters_start(const char *name, Core *cores, uint8 count) {
+	counters_name = name;
+	counters_cores = cores;
+	counters_count = count;
+
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	std::thread(reporter, set).detach();
+}
+
+void counters_finish() {
+	if (counters_name != NULL)
+		write_named();
+}
@@ -0,0 +1,151 @@
+#include <disk.h>
+#include <core.h>
+#include <loader.h>
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+
+Disk disk;
+
+
+static void disk_read(void *device, uint64 offset, uint8 size, uint8 *data) {
+	Disk *d = (Disk*)device;
+	uint64 val = offset == DISK_SECTORS ? d->sectors : 0;
+
+	memcpy(data, &val, size < 8 ? size : 8);
+
+	if (size > 8)
+		memset(data + 8, 0, size - 8);
+}
+
+static void disk_write(void *device, uint64 offset, uint8 size, const uint8 *data) {
+	uint64 val = 0;
+
+	memcpy(&val, data, size < 8 ? size : 8);
+
+	if (offset == DISK_SUBMIT)
+		((Disk*)device)->submit(current_core, val);
+}
+
+
+Disk::Disk() {
+	fd = -1;
+	readonly = false;
+	size = 0;
+	sectors = 0;
+}
+
+
+// opened once for the whole run, claims the registers on the bus
+bool Disk::open(const char *name, bool _readonly) {
+	readonly = _readonly;
+	fd = ::open(name, readonly ? O_RDONLY : O_RDWR);
+
+	struct stat st;
+
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		printf("Can not open disk %s!\n", name);
+		return false;
+	}
+
+	size = st.st_size;
+	sectors = (size + DISK_SECTOR - 1) / DISK_SECTOR;
+
+	BusRange range = {DISK_BASE, DISK_SIZE, "disk", this, disk_read, disk_write};
+
+	return bus.claim(range);
+}
+
+// the request has to lie in RAM, anything wrong with what it asks for
+// only shows in its status
+void Disk::submit(Core *c, uint64 addr) {
+	Memory *mem = c->mem;
+
+	if ((addr & 7) || addr > mem->size || mem->size - addr < sizeof(DiskRequest))
+		c->fault(FAULT_BOUNDS, addr);
+
+	DiskRequest req;
+	memcpy(&req, mem->base + addr, sizeof(req));
+
+	req.status = run(mem, &req);
+	mem->store<uint64>(addr + offsetof(DiskRequest, status), req.status);
+
+	c->irq.post(IRQ_DISK);
+}
+
+uint64 Disk::run(Memory *mem, DiskRequest *req) {
+	if (req->sector > sectors || req->count > sectors - req->sector)
+		return DISK_ERROR;
+
+	uint64 bytes = req->count * DISK_SECTOR;
+
+	if (req->addr > mem->size || bytes > mem->size - req->addr)
+		return DISK_ERROR;
+
+	if (bytes == 0)
+		return DISK_OK;
+
+	uint64 offset = req->sector * DISK_SECTOR;
+	bool ok = false;
+
+	if (req->command == DISK_READ)
+		ok = read(mem, offset, req->addr, bytes);
+	else if (req->command == DISK_WRITE && !readonly)
+		ok = write(mem, offset, req->addr, bytes);
+
+	return ok ? DISK_OK : DISK_ERROR;
+}
+
+bool Disk::read(Memory *mem, uint64 offset, uint64 addr, uint64 bytes) {
+	uint64 end = __atomic_load_n(&size, __ATOMIC_ACQUIRE);
+	uint64 inside = offset < end ? end - offset : 0;
+
+	if (inside > bytes)
+		inside = bytes;
+
+	bool ok = true;
+
+	// a writable file may change under a private mapping, RAM must not
+	if (readonly) {
+		ok = map_range(mem, fd, offset, addr, inside);
+	} else {
+		for (uint64 done = 0; done < inside; ) {
+			ssize_t n = pread(fd, mem->base + addr + done, inside - done, offset + done);
+
+			if (n <= 0) {
+				ok = false;
+				break;
+			}
+
+			done += n;
+		}
+	}
+
+	memset(mem->base + addr + inside, 0, bytes - inside);
+	mem->code_write_range(addr, bytes);
+
+	return ok;
+}
+
+bool Disk::write(Memory *mem, uint64 offset, uint64 addr, uint64 bytes) {
+	for (uint64 done = 0; done < bytes; ) {
+		ssize_t n = pwrite(fd, mem->base + addr + done, bytes - done, offset + done);
+
+		if (n <= 0)
+			return false;
+
+		done += n;
+	}
+
+	// only grows, whichever core's write ends furthest wins
+	uint64 end = __atomic_load_n(&size, __ATOMIC_RELAXED);
+
+	while (offset + bytes > end && !__atomic_compare_exchange_n(&size, &end, offset + bytes,
+			true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	return true;
+}
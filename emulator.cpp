@@ -1,70 +1,454 @@
 #include <core.h>
 #include <utils.h>
 #include <register.h>
+#include <runner.h>
+#include <trace.h>
+#include <smp.h>
+#include <loader.h>
+#include <snapshot.h>
+#include <fork.h>
+#include <batch.h>
+#include <counters.h>
+#include <profiler.h>
+#include <console.h>
+#include <disk.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <signal.h>
 
+#include <thread>
 
-uint8 *ram;
+
+#define IMAGES_MAX 16
+
+
+Memory memory;
 Core *cores;
 
-uint8 *bios;
 
 char *bios_name = (char*)"std_bios";
+char *save_name = NULL;
+char *restore_name = NULL;
+char *counters_name = NULL;
+char *profile_name = NULL;
+char *console_name = NULL;
+char *disk_name = NULL;
+bool disk_readonly = false;
+char *batch_name = NULL;
+char *batch_out = (char*)"batch.out";
+uint32 batch_workers = 0;
+
+char *images[IMAGES_MAX];
+uint64 image_addrs[IMAGES_MAX];
+int images_count = 0;
+
 uint64 ram_size = 1024 * 1024 * 1; // 1 M
 uint8 cores_count = 1;
 
 
 
-int main() {
-	ram = new uint8[ram_size];
-	cores = new Core[cores_count];
+// 64K, 512M, 16G, 1T or plain bytes, 0 when malformed
+static uint64 parse_size(const char *text) {
+	char *end;
+	uint64 size = strtoull(text, &end, 0);
+	uint64 unit = 1;
 
-	for (int i = 0; i < cores_count; i++) {
-		cores[i].init(i);
+	switch (*end) {
+		case 'k': case 'K': unit = 1UL << 10; end++; break;
+		case 'm': case 'M': unit = 1UL << 20; end++; break;
+		case 'g': case 'G': unit = 1UL << 30; end++; break;
+		case 't': case 'T': unit = 1UL << 40; end++; break;
+	}
+
+	if (*end != 0 || size > ~0UL / unit)
+		return 0;
+
+	return size * unit;
+}
+
+
+// name for this process: forked children add their index
+static const char *own_name(const char *name, char *buf, uint64 size) {
+	if (name == NULL || forks.index == 0)
+		return name;
+
+	snprintf(buf, size, "%s.%d", name, forks.index);
+
+	return buf;
+}
+
+
+static void usage(const char *name) {
+	printf("usage: %s [options]\n", name);
+	printf("\t--bios FILE     BIOS image (default std_bios), raw ones load at %d\n", BIOS_OFFSET);
+	printf("\t--image F[@A]   also load image F, a raw one at address A, up to %d times\n", IMAGES_MAX);
+	printf("\t--restore FILE  start from a snapshot instead of the BIOS, with its RAM and cores\n");
+	printf("\t--save FILE     snapshot all cores and RAM to FILE once the run stops\n");
+	printf("\t--fork N        fork makes N copies of the machine sharing RAM (default 0)\n");
+	printf("\t--fork-inputs F per child a line of rN=VALUE register values, fork makes as many,\n");
+	printf("\t                --fork may repeat that count but not change it\n");
+	printf("\t--batch FILE    run the jobs listed in FILE instead, see batch.cpp\n");
+	printf("\t--batch-out F   where --batch writes results (default batch.out)\n");
+	printf("\t--workers N     threads for --batch (default one per host CPU)\n");
+	printf("\t--counters FILE write per core counters as JSON to FILE at exit and on SIGUSR1,\n");
+	printf("\t                which without it goes to stderr. Not with --batch\n");
+	printf("\t--profile FILE  sample where the cores are, folded stacks for flame graphs to FILE\n");
+	printf("\t--profile-hz N  samples per second (default %d)\n", PROFILE_HZ);
+	printf("\t--profile-stacks also find callers on the guest stack\n");
+	printf("\t--symbols FILE  name samples by the ADDR NAME lines in FILE\n");
+	printf("\t--console FILE  guest console output to FILE instead of stdout, at %lx\n", CONSOLE_BASE);
+	printf("\t--disk FILE     FILE as a disk at %lx, see disk.h\n", DISK_BASE);
+	printf("\t--disk-ro FILE  the same, read only\n");
+	printf("\t--step          execute one instruction per line read from stdin\n");
+	printf("\t--trace LEVEL   1: trace instructions, 2: and registers\n");
+	printf("\t--trace-file F  write the trace to F instead of stderr\n");
+	printf("\t--insns N       stop each core after N instructions\n");
+	printf("\t--time SECONDS  stop after SECONDS of wall-clock time\n");
+	printf("\t--jit           compile hot blocks to native code\n");
+	printf("\t--cores N       number of cores\n");
+	printf("\t--ram SIZE      RAM size, K, M, G and T suffixes work (default 1M)\n");
+	printf("\t--hugepages     back RAM with transparent huge pages\n");
+	printf("\t--smp MODE      threads: a host thread per core (default),\n");
+	printf("\t                rr: all cores in turns on one thread, reproducible\n");
+	printf("\t--quantum N     instructions per turn with --smp rr (default %d)\n", SMP_QUANTUM);
+}
+
+
+int main(int argc, char **argv) {
+	Runner runner;
+	bool jit = false;
+	bool huge = false;
+	int fork_count = -1;
+
+	for (int i = 1; i < argc; i++) {
+		bool has_value = i + 1 < argc;
+
+		if (strcmp(argv[i], "--step") == 0) {
+			runner.mode = RUN_STEP;
+		} else if (strcmp(argv[i], "--trace") == 0 && has_value) {
+			trace.level = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--trace-file") == 0 && has_value) {
+			if (!trace.open(argv[++i])) {
+				printf("Can not open %s!\n", argv[i]);
+				return 2;
+			}
+		} else if (strcmp(argv[i], "--jit") == 0) {
+			jit = true;
+		} else if (strcmp(argv[i], "--bios") == 0 && has_value) {
+			bios_name = argv[++i];
+		} else if (strcmp(argv[i], "--restore") == 0 && has_value) {
+			restore_name = argv[++i];
+		} else if (strcmp(argv[i], "--counters") == 0 && has_value) {
+			counters_name = argv[++i];
+		} else if (strcmp(argv[i], "--profile") == 0 && has_value) {
+			profile_name = argv[++i];
+		} else if (strcmp(argv[i], "--console") == 0 && has_value) {
+			console_name = argv[++i];
+		} else if ((strcmp(argv[i], "--disk") == 0 || strcmp(argv[i], "--disk-ro") == 0) && has_value) {
+			disk_readonly = strcmp(argv[i], "--disk-ro") == 0;
+			disk_name = argv[++i];
+		} else if (strcmp(argv[i], "--profile-hz") == 0 && has_value) {
+			profiler.hz = atoi(argv[++i]);
+
+			if (profiler.hz < 1 || profiler.hz > 1000000) {
+				printf("--profile-hz takes 1 to 1000000\n");
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--profile-stacks") == 0) {
+			profiler.stacks = true;
+		} else if (strcmp(argv[i], "--symbols") == 0 && has_value) {
+			if (!profiler.load_symbols(argv[++i]))
+				return 1;
+		} else if (strcmp(argv[i], "--save") == 0 && has_value) {
+			save_name = argv[++i];
+		} else if (strcmp(argv[i], "--fork") == 0 && has_value) {
+			fork_count = atoi(argv[++i]);
+
+			if (fork_count < 0 || fork_count > FORK_MAX) {
+				printf("--fork takes up to %d\n", FORK_MAX);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--fork-inputs") == 0 && has_value) {
+			if (!forks.load(argv[++i]))
+				return 1;
+		} else if (strcmp(argv[i], "--batch") == 0 && has_value) {
+			batch_name = argv[++i];
+		} else if (strcmp(argv[i], "--batch-out") == 0 && has_value) {
+			batch_out = argv[++i];
+		} else if (strcmp(argv[i], "--workers") == 0 && has_value) {
+			batch_workers = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--image") == 0 && has_value) {
+			char *at = strrchr(argv[++i], '@');
+
+			if (images_count == IMAGES_MAX) {
+				usage(argv[0]);
+				return 1;
+			}
+
+			images[images_count] = argv[i];
+			image_addrs[images_count] = 0;
+
+			if (at != NULL) {
+				*at = 0;
+				image_addrs[images_count] = strtoull(at + 1, NULL, 0);
+			}
+
+			images_count++;
+		} else if (strcmp(argv[i], "--insns") == 0 && has_value) {
+			runner.max_insns = strtoull(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "--time") == 0 && has_value) {
+			runner.max_seconds = atof(argv[++i]);
+		} else if (strcmp(argv[i], "--cores") == 0 && has_value) {
+			int n = atoi(argv[++i]);
+
+			if (n < 1 || n > 255) {
+				printf("--cores takes 1 to 255\n");
+				return 1;
+			}
+
+			cores_count = n;
+		} else if (strcmp(argv[i], "--ram") == 0 && has_value) {
+			ram_size = parse_size(argv[++i]);
+
+			if (ram_size <= BIOS_OFFSET || ram_size > BUS_BASE) {
+				printf("--ram takes a size above %d bytes, like 64M or 4G, up to %luT\n", BIOS_OFFSET, BUS_BASE >> 40);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--hugepages") == 0) {
+			huge = true;
+		} else if (strcmp(argv[i], "--smp") == 0 && has_value) {
+			i++;
+
+			if (strcmp(argv[i], "threads") == 0) {
+				smp.mode = SMP_THREADS;
+			} else if (strcmp(argv[i], "rr") == 0) {
+				smp.mode = SMP_RR;
+			} else {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--quantum") == 0 && has_value) {
+			smp.quantum = strtoull(argv[++i], NULL, 0);
+
+			if (smp.quantum == 0) {
+				printf("--quantum has to be at least 1\n");
+				return 1;
+			}
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
 	}
 
+	// children past the last line would have no inputs to start with
+	if (fork_count >= 0) {
+		if (forks.inputs != NULL && (uint32)fork_count != forks.count) {
+			printf("--fork %d does not match the %u lines of --fork-inputs\n", fork_count, forks.count);
+			return 1;
+		}
+
+		forks.count = fork_count;
+	}
+
+	if (runner.mode == RUN_STEP && trace.level == TRACE_OFF)
+		trace.level = TRACE_REGS;
+
+	if (!console.open(console_name))
+		return 2;
+
+	if (disk_name != NULL && !disk.open(disk_name, disk_readonly))
+		return 2;
+
+	if (batch_name != NULL) {
+		Batch batch;
+
+		if (runner.stepping()) {
+			printf("--batch does not step or trace\n");
+			return 1;
+		}
+
+		if (counters_name != NULL) {
+			printf("--batch keeps no counters\n");
+			return 1;
+		}
+
+		// no reporter takes it, and its default action would lose every
+		// result not written yet
+		signal(SIGUSR1, SIG_IGN);
+
+		if (batch_workers == 0)
+			batch_workers = std::thread::hardware_concurrency();
 
-	INFO("reading BIOS\n");
+		if (batch_workers == 0)
+			batch_workers = 1;
 
-	FILE *f = fopen(bios_name, "rb");
+		batch.ram_size = ram_size;
+		batch.huge = huge;
+		batch.jit = jit;
+		batch.budget = runner;
 
-	if (f == NULL) {
-		printf("File %s not found!\n", bios_name);
+		if (!batch.load(batch_name))
+			return 2;
+
+		return batch.run(batch_out, batch_workers);
+	}
+
+	if (restore_name != NULL && !snapshot_probe(restore_name, &ram_size, &cores_count))
 		return 2;
+
+	if (!memory.init(ram_size, huge)) {
+		printf("Can not allocate %lu bytes of RAM!\n", ram_size);
+		return 2;
+	}
+
+	cores = new Core[cores_count];
+
+	for (int i = 0; i < cores_count; i++) {
+		cores[i].init(i, &memory);
 	}
 
-	fseek(f, 0L, SEEK_END);
-	uint32 bios_size = ftell(f);
-	rewind(f);
 
-	bios = new uint8[bios_size];
+	ImageEntry entry;
+
+	if (restore_name != NULL) {
+		INFO("restoring snapshot\n");
 
-	fread(bios, 1, bios_size, f);
+		if (!snapshot_restore(restore_name, &memory, cores, cores_count))
+			return 2;
+	} else {
+		INFO("loading BIOS\n");
 
-	fclose(f);
+		if (!load_image(&memory, bios_name, BIOS_OFFSET, &entry))
+			return 2;
 
+		// a raw BIOS starts at its first byte
+		if (!entry.valid) {
+			entry.pc = 0;
+			entry.lo = BIOS_OFFSET;
+			entry.sp = BIOS_OFFSET;
+		}
+	}
 
-	INFO("writing BIOS\n");
+	for (int i = 0; i < images_count; i++) {
+		ImageEntry ignored;
 
-	for (int i = 0; i < bios_size; i++) {
-		ram[i + BIOS_OFFSET] = bios[i];
+		if (!load_image(&memory, images[i], image_addrs[i], &ignored))
+			return 2;
 	}
 
 
-	INFO("init core 0\n");
+	if (restore_name == NULL) {
+		INFO("init core 0\n");
+
+		cores[0].set_flag(FLAG_RUNNING, 1);
+		cores[0].regs[REG_PC].ul = entry.pc;
+		cores[0].regs[REG_LO].ul = entry.lo;
+		cores[0].regs[REG_SP].ul = entry.sp;
+	}
+
+	for (int i = 0; i < cores_count; i++)
+		cores[i].use_jit = jit && !runner.stepping();
+
+	char name[PATH_MAX];
+
+	counters_start(counters_name, cores, cores_count);
+
+	if (profile_name != NULL)
+		profiler.start(cores, cores_count);
+
+	uint8 reason;
+	uint64 retired = 0;
+	double seconds = 0;
+
+	// each time round with fresh budgets
+	for (;;) {
+		runner.retired = 0;
+
+		// round robin steps and traces every core, the threads can not, so
+		// there stepping and tracing follow core 0 alone on this thread
+		if (smp.mode == SMP_RR || !runner.stepping())
+			reason = smp.run(&runner, cores, cores_count);
+		else
+			reason = runner.run(&cores[0]);
+
+		retired += runner.retired;
+		seconds += runner.seconds;
+
+		bool forking = false;
 
-	cores[0].set_flag(FLAG_RUNNING, 1);
-	cores[0].regs[REG_LO].ul = BIOS_OFFSET;
-	cores[0].regs[REG_SP].ul = BIOS_OFFSET;
+		for (int i = 0; i < cores_count; i++)
+			forking |= cores[i].get_flag(FLAG_FORK);
 
-	while (cores[0].get_flag(FLAG_RUNNING)) {
-		cores[0].step();
+		if (!forking)
+			break;
 
-		getc(stdin);
+		if (forks.count != 0) {
+			int status;
+
+			if (forks.spawn(&status) == 0) {
+				counters_finish();
+
+				if (profile_name != NULL && !profiler.finish(profile_name))
+					return 2;
+
+				fprintf(stderr, "%d children, highest exit status %d\n", forks.count, status);
+				return status;
+			}
+
+			// the reporter and sampler threads stayed in the parent
+			counters_start(own_name(counters_name, name, sizeof(name)), cores, cores_count);
+
+			if (profile_name != NULL) {
+				profile_name = strdup(own_name(profile_name, name, sizeof(name)));
+				profiler.start(cores, cores_count);
+			}
+		}
+
+		forks.resume(cores, cores_count);
 	}
 
+	trace.flush();
+
+	if (reason == STOP_INSNS)
+		INFO("instruction budget used up\n");
+
+	if (reason == STOP_TIMEOUT)
+		INFO("time budget used up\n");
+
 	INFO("all cores stoped. exit\n");
 
-	return 0;
+	counters_finish();
+	console.flush();
+
+	if (profile_name != NULL && !profiler.finish(profile_name))
+		return 2;
+
+	if (save_name != NULL && !snapshot_save(own_name(save_name, name, sizeof(name)), &memory, cores, cores_count))
+		return 2;
+
+	int status = 0;
+
+	for (int i = 0; i < cores_count; i++) {
+		Core *c = &cores[i];
+
+		if (c->fault_code == FAULT_NONE)
+			continue;
+
+		if (forks.index != 0)
+			fprintf(stderr, "child %d: ", forks.index);
+
+		fprintf(stderr, "core %d: %s at pc %016lx, address %016lx\n",
+				i, fault_names[c->fault_code], c->regs[REG_PC].ul, c->fault_addr);
+		status = 3;
+	}
+
+	if (forks.index != 0)
+		fprintf(stderr, "child %d: ", forks.index);
+
+	fprintf(stderr, "%lu instructions in %.3f s\n", retired, seconds);
+
+	return status;
 }
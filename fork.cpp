@@ -0,0 +1,133 @@
+#include <fork.h>
+#include <core.h>
+#include <trace.h>
+#include <console.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+
+Forks forks;
+
+
+Forks::Forks() {
+	count = 0;
+	inputs = NULL;
+	index = 0;
+}
+
+
+// one child per line of "rN=VALUE" words, say "r1=5 r2=0x10". Empty lines
+// are children without inputs, # starts a comment
+bool Forks::load(const char *name) {
+	FILE *f = fopen(name, "r");
+
+	if (f == NULL) {
+		printf("File %s not found!\n", name);
+		return false;
+	}
+
+	inputs = new ForkInput[FORK_MAX];
+	count = 0;
+
+	char line[1024];
+	int number = 0;
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		number++;
+
+		char *comment = strchr(line, '#');
+
+		if (comment != NULL)
+			*comment = 0;
+
+		if (count == FORK_MAX) {
+			printf("%s: more than %d children\n", name, FORK_MAX);
+			fclose(f);
+			return false;
+		}
+
+		ForkInput *in = &inputs[count++];
+		in->mask = 0;
+
+		for (char *word = strtok(line, " \t\r\n"); word != NULL; word = strtok(NULL, " \t\r\n")) {
+			uint8 reg;
+			uint64 value;
+
+			if (!parse_assignment(word, &reg, &value) || reg >= REGISTERS_COUNT) {
+				printf("%s:%d: expected rN=VALUE, not %s\n", name, number, word);
+				fclose(f);
+				return false;
+			}
+
+			in->mask |= 1 << reg;
+			in->regs[reg] = value;
+		}
+	}
+
+	fclose(f);
+
+	return true;
+}
+
+
+// forks the children and waits for all of them. Returns the index of the
+// child in a child, 0 in the parent with the highest exit status in status
+uint32 Forks::spawn(int *status) {
+	*status = 0;
+
+	// or every child writes out what the parent had buffered
+	trace.flush();
+	console.flush();
+	fflush(NULL);
+
+	for (uint32 i = 1; i <= count; i++) {
+		pid_t pid = fork();
+
+		if (pid == 0) {
+			timers.after_fork();
+			index = i;
+			return i;
+		}
+
+		if (pid < 0) {
+			printf("Can not fork child %d!\n", i);
+			*status = 2;
+			break;
+		}
+	}
+
+	int child;
+
+	while (wait(&child) > 0) {
+		int code = WIFEXITED(child) ? WEXITSTATUS(child) : 2;
+
+		if (code > *status)
+			*status = code;
+	}
+
+	return 0;
+}
+
+// the cores that executed fork go on after it, with this child's inputs
+void Forks::resume(Core *cores, uint8 _count) {
+	for (int i = 0; i < _count; i++) {
+		Core *c = &cores[i];
+
+		if (!c->get_flag(FLAG_FORK))
+			continue;
+
+		c->set_flag(FLAG_FORK, 0);
+		c->set_flag(FLAG_RUNNING, 1);
+
+		if (inputs == NULL || index == 0)
+			continue;
+
+		for (int r = 0; r < REGISTERS_COUNT; r++)
+			if (inputs[index - 1].mask & (1 << r))
+				c->regs[r].ur = inputs[index - 1].regs[r];
+	}
+}
@@ -0,0 +1,23 @@
+#include <icache.h>
+#include <memory.h>
+
+
+void ICache::init(Memory *_mem) {
+	entries = new Instruction[ICACHE_SIZE];
+	mem = _mem;
+
+	flush();
+}
+
+void ICache::release() {
+	delete[] entries;
+	entries = NULL;
+}
+
+void ICache::flush() {
+	for (int i = 0; i < ICACHE_SIZE; i++)
+		entries[i].addr = ICACHE_EMPTY;
+
+	epoch = mem->code_epoch_now();
+}
+
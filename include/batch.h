@@ -0,0 +1,103 @@
+#pragma once
+
+#include <utils.h>
+#include <register.h>
+#include <memory.h>
+#include <snapshot.h>
+#include <runner.h>
+#include <loader.h>
+
+#include <deque>
+#include <mutex>
+#include <vector>
+
+
+#define BATCH_MAGIC   0x54554f42 // "BOUT" read as little endian
+#define BATCH_VERSION 1
+
+#define BATCH_LOAD_FAILED 0xff // in BatchResult::fault, the job never ran
+
+
+// An image loaded once, that every job using it starts from
+struct BatchImage {
+	char *name;
+	Memory mem;
+	std::vector<SnapshotRun> runs; // what loading it wrote to RAM
+	ImageEntry entry;
+};
+
+struct BatchJob {
+	BatchImage *image;
+	uint16 mask; // bit i set: regs[i] replaces the entry value
+	uint64 regs[REGISTERS_COUNT];
+
+	char *input; // copied to RAM at input_addr before the start, or NULL
+	uint64 input_addr;
+
+	uint64 output_addr; // RAM saved with the result
+	uint64 output_size;
+};
+
+
+// The output file is this header, then a BatchResult per job in the order
+// they finished, each followed by output_size bytes of RAM. Registers are
+// saved as their low 64 bits.
+struct BatchHeader {
+	uint32 magic;
+	uint16 version;
+	uint16 registers;
+	uint64 jobs;
+};
+
+struct BatchResult {
+	uint32 job; // its index in the manifest, lines without a job not counted
+	uint8 reason; // STOP_*
+	uint8 fault;  // FAULT_*, or BATCH_LOAD_FAILED
+	uint16 reserved;
+	uint64 retired;
+	uint64 fault_addr;
+	uint64 regs[REGISTERS_COUNT];
+	uint64 output_size;
+};
+
+
+// one worker's jobs. It takes them from the front, an idle worker steals
+// from the back
+struct BatchQueue {
+	std::mutex lock;
+	std::deque<uint32> jobs;
+};
+
+
+// Many independent single core machines from one manifest. Each worker
+// thread keeps its core and RAM for all the jobs it runs, RAM is only
+// cleared in between, and keeps its decoded and compiled code as long as
+// the jobs run the same unmodified image.
+struct Batch {
+	std::vector<BatchImage*> images;
+	std::vector<BatchJob> jobs;
+
+	BatchQueue *queues;
+	uint32 workers;
+
+	FILE *out;
+	std::mutex out_lock;
+
+	uint64 ram_size;
+	bool huge;
+	bool jit;
+	Runner budget; // for every job
+
+	uint64 retired;
+	uint32 faulted;
+	bool broken; // some worker lost its RAM
+
+	Batch();
+
+	bool load(const char *manifest);
+	int run(const char *output, uint32 workers);
+
+	bool next(uint32 worker, uint32 *job);
+	void work(uint32 worker);
+	void write(BatchResult*, uint8 *output);
+};
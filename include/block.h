@@ -0,0 +1,75 @@
+#pragma once
+
+#include <utils.h>
+#include <icache.h>
+
+
+#define BLOCK_MAX 64 // instructions
+
+#define BCACHE_BITS 10
+#define BCACHE_SIZE (1 << BCACHE_BITS)
+#define BCACHE_ARENA (4 * 1024 * 1024)
+#define BCACHE_DIRTY 1024 // blocks run since the last fold
+
+
+struct Core;
+
+typedef void (*JitCode)(Core*);
+
+
+struct Block {
+	uint64 addr; // LO + PC of the first instruction
+	uint32 count;
+	uint32 execs;
+	uint64 runs; // since the last fold
+	Block *next[2]; // successors seen so far, checked by addr before use
+	JitCode code;   // compiled version, once the block got hot
+
+	Instruction insns[];
+};
+
+
+struct BlockStats {
+	uint64 hits;
+	uint64 chained;
+	uint64 misses;
+	uint64 invalidations;
+};
+
+
+struct BlockCache {
+	Block *table[BCACHE_SIZE];
+	uint8 *arena;
+	uint64 used;
+	Memory *mem;  // whose code_epoch it follows
+	uint64 epoch;
+
+	BlockStats stats;
+
+	uint64 op_counts[256]; // instructions run by blocks, by opcode
+	Block *dirty[BCACHE_DIRTY];
+	uint32 dirty_count;
+
+	void init(Memory*);
+	void release();
+	void flush();
+	void fold();
+
+	// counted per block, the opcodes are added up by fold()
+	void ran(Block *b) {
+		if (b->runs++ == 0) {
+			if (dirty_count == BCACHE_DIRTY)
+				fold();
+
+			dirty[dirty_count++] = b;
+		}
+	}
+
+	Block *lookup(uint64 addr) {
+		Block *b = table[(addr ^ (addr >> BCACHE_BITS)) & (BCACHE_SIZE - 1)];
+		return b != NULL && b->addr == addr ? b : NULL;
+	}
+
+	Block *build(Core*, uint64);
+	void link(Block*, Block*);
+};
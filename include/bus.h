@@ -0,0 +1,38 @@
+#pragma once
+
+#include <utils.h>
+
+#include <vector>
+
+
+#define BUS_BASE (1UL << 44) // devices sit from here on, RAM has to end below
+
+
+// an access of size bytes at offset into the device's range, data is
+// little endian like RAM
+typedef void (*BusRead)(void *device, uint64 offset, uint8 size, uint8 *data);
+typedef void (*BusWrite)(void *device, uint64 offset, uint8 size, const uint8 *data);
+
+struct BusRange {
+	uint64 start; // physical
+	uint64 size;
+	const char *name;
+
+	void *device;
+	BusRead read;
+	BusWrite write;
+};
+
+
+// Physical addresses past the end of RAM, claimed by devices. Accesses
+// only get here once the RAM bounds check failed, so RAM pays nothing for
+// them. Ranges are sorted by start and looked up with a binary search.
+struct Bus {
+	std::vector<BusRange> ranges;
+
+	bool claim(BusRange);
+	BusRange *find(uint64 addr, uint64 size);
+};
+
+
+extern Bus bus;
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <utils.h>
+#include <bus.h>
+
+#include <mutex>
+
+
+#define CONSOLE_BASE BUS_BASE
+#define CONSOLE_SIZE 0x1000
+
+// registers, offsets from CONSOLE_BASE
+#define CONSOLE_DATA  0 // a store appends its bytes, as many as it is wide
+#define CONSOLE_FLUSH 8 // any store writes out what is buffered
+
+#define CONSOLE_BUFFER (64 * 1024)
+
+
+// A serial port that only outputs. Bytes collect in a buffer that is
+// written out when full, on CONSOLE_FLUSH and at exit, and after every
+// line when it goes to a terminal, like stdio does. Loads read zero.
+struct Console {
+	std::mutex lock;
+	int fd;
+	bool lines;
+
+	uint8 buffer[CONSOLE_BUFFER];
+	uint32 used;
+
+	Console();
+	~Console();
+
+	bool open(const char *name);
+	void put(const uint8*, uint64);
+	void flush();
+	void flush_locked();
+};
+
+
+extern Console console;
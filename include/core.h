@@ -3,6 +3,15 @@
 
 #include <register.h>
 #include <utils.h>
+#include <icache.h>
+#include <block.h>
+#include <jit.h>
+#include <memory.h>
+#include <mmu.h>
+#include <counters.h>
+#include <irq.h>
+
+#include <setjmp.h>
 
 
 #define ALU_SUM 0
@@ -12,32 +21,182 @@
 #define ALU_IMUL 4
 #define ALU_IDIV 5
 
+#define COND_E  0
+#define COND_NE 1
+#define COND_B  2
+#define COND_BE 3
+#define COND_L  4
+#define COND_LE 5
+
+#define FAULT_NONE    0
+#define FAULT_BOUNDS  1 // data access outside RAM
+#define FAULT_FETCH   2 // instruction outside RAM
+#define FAULT_ILLEGAL 3 // illegal opcode or register
+#define FAULT_ALIGN   4 // misaligned atomic
+#define FAULT_PAGE    5 // no valid translation or no permission
+
+// system registers, mfsr and mtsr
+#define SR_MMU_ROOT   0 // page table root, 0 is off
+#define SR_TLB_FLUSH  1 // any write flushes the TLB
+#define SR_TLB_HITS   2
+#define SR_TLB_MISSES 3
+#define SR_FORK_INDEX 4 // 0, or which child of a fork this is from 1; children can not fork
+#define SR_IRQ_VECTOR  5  // handler table, see Irq
+#define SR_IRQ_MASK    6  // bit per line, set ones get taken
+#define SR_IRQ_ENABLE  7  // 0 or 1, iret and taking one change it
+#define SR_IRQ_PENDING 8  // writing ones clears those lines
+#define SR_IRQ_CAUSE   9  // line of the running handler
+#define SR_IRQ_PC      10 // where iret returns to
+#define SR_TIMER_INSNS 11 // IRQ_TIMER every that many instructions run, 0 is off
+#define SR_TIMER_NS    12 // IRQ_TIMER every that many host nanoseconds, 0 is off
+#define SR_DOORBELL    13 // reading clears it
+
 
 struct Core {
 	Register regs[REGISTERS_COUNT];
 	uint64 flag;
 	uint8 id;
 
+	uint128 last_a, last_b; // operands of the last ALU operation
+	bool lazy_flags;        // EQUALS/LESS/MORE in flag are stale
+
+	ICache icache;
+	BlockCache bcache;
+	Jit jit;
+	bool use_jit;
+
+	// physical span decode() read since it was last reset, for batch jobs
+	uint64 decoded_lo, decoded_hi;
+
+	Memory *mem;
+	Mmu mmu;
+	Instruction *insn;     // the executing one, faults rewind PC to it
+	Block *block;          // the one run_blocks() executes, for faults in it
+	sigjmp_buf *fault_jmp; // where a fault unwinds to while executing
+	uint8 fault_code;      // FAULT_*, why the core stopped
+	uint64 fault_addr;
+
+	Counters counters;
+	Irq irq;
+
 	Core();
-	void init(uint8);
+	void init(uint8, Memory*);
+	void release();
 
 	void clear();
 	void step();
+	void trace_step();
+	template<bool> void step_as();
+	uint64 run(uint64);
+	void run_blocks(uint64, volatile uint64*);
+	void decode(uint64, Instruction*);
+	void reset_decoded();
+	uint64 fetch(uint64, uint8*, uint64*, uint8*);
+
+	uint64 read_sr(uint8);
+	void write_sr(uint8, uint64);
+	void take_irq();
+	void io(uint64, uint8, uint8*, bool);
 
 	void set_flag(uint8, uint8);
 	uint8 get_flag(uint8);
+	void materialize_flags();
+	bool condition(uint8);
+
+	template<uint8, class T> T ALU(T,T);
+
+	uint8   pop1 (uint64 addr) { return pop<uint8>  (addr); }
+	uint16  pop2 (uint64 addr) { return pop<uint16> (addr); }
+	uint32  pop4 (uint64 addr) { return pop<uint32> (addr); }
+	uint64  pop8 (uint64 addr) { return pop<uint64> (addr); }
+	uint128 pop16(uint64 addr) { return pop<uint128>(addr); }
+
+	// with the MMU on, addresses are virtual. Accesses that cross a page go
+	// a byte at a time, the pages need not be contiguous. Past RAM they go
+	// to the bus, which faults on ones that start inside RAM
+	template<class T> T pop(uint64 addr) {
+		if (mmu.root != 0) {
+			if (page_crossed(addr, sizeof(T)))
+				return pop_split<T>(addr);
+
+			addr = translate(addr, MMU_READ);
+		}
+
+		if (!mem->contains(addr, sizeof(T))) {
+			T val;
+			io(addr, sizeof(T), (uint8*)&val, false);
+			return val;
+		}
 
-	template<class T> T ALU(T,T,uint8);
+		return mem->load<T>(addr);
+	}
 
-	uint8   pop1 (uint64);
-	uint16  pop2 (uint64);
-	uint32  pop4 (uint64);
-	uint64  pop8 (uint64);
-	uint128 pop16(uint64);
+	template<class T> void push(T val, uint64 addr) {
+		if (mmu.root != 0) {
+			if (page_crossed(addr, sizeof(T)))
+				return push_split<T>(val, addr);
 
-	template<class T> void push(T, uint64);
+			addr = translate(addr, MMU_WRITE);
+		}
 
-	void illegal();
+		if (!mem->contains(addr, sizeof(T)))
+			return io(addr, sizeof(T), (uint8*)&val, true);
+
+		mem->store<T>(addr, val);
+		mem->code_write(addr, sizeof(T));
+	}
+
+	template<class T> T pop_split(uint64 addr) {
+		T val = 0;
+
+		for (int i = 0; i < sizeof(T); i++)
+			val |= (T)pop<uint8>(addr + i) << (i * 8);
+
+		return val;
+	}
+
+	// both pages first, so a fault leaves RAM as it was
+	template<class T> void push_split(T val, uint64 addr) {
+		translate(addr, MMU_WRITE);
+		translate(addr + sizeof(T) - 1, MMU_WRITE);
+
+		for (int i = 0; i < sizeof(T); i++)
+			push<uint8>(val >> (i * 8), addr + i);
+	}
+
+	uint64 translate(uint64 vaddr, uint8 access) {
+		uint64 phys;
+
+		if (!mmu.translate(mem, vaddr, access, &phys))
+			fault(FAULT_PAGE, vaddr);
+
+		return phys;
+	}
+
+	// after in ended a block or a step
+	void count_exit(Instruction *in) {
+		if (in->flags & INSN_BRANCH) {
+			uint8 i = in->op - COUNTERS_BRANCH_FIRST;
+
+			if (regs[REG_PC].ul + regs[REG_LO].ul == in->addr + in->size)
+				counters.not_taken[i]++;
+			else
+				counters.taken[i]++;
+		} else if (in->flags & INSN_CALL) {
+			if (++counters.depth > counters.max_depth)
+				counters.max_depth = counters.depth;
+		} else if (in->flags & INSN_RET) {
+			counters.depth--;
+		}
+	}
+
+	[[noreturn]] void fault(uint8 code, uint64 addr);
 
 	void print_info();
 };
+
+
+// the core executing on this thread, for the SIGSEGV handler
+extern thread_local Core *current_core;
+
+extern const char *fault_names[];
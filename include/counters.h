@@ -0,0 +1,40 @@
+#pragma once
+
+#include <utils.h>
+
+#include <stdio.h>
+
+
+#define COUNTERS_BRANCHES 12 // je ... jle, 0x5c to 0x67
+#define COUNTERS_BRANCH_FIRST 0x5c
+
+
+struct Core;
+
+
+// Per core and only ever written by the thread running it, so plain
+// increments. Readers from other threads see values up to one run() slice
+// old; opcodes run inside blocks are counted per block and folded in by
+// the block cache, see BlockCache::fold(). Retired instructions and bytes
+// read and written follow from the opcodes, every one accesses a fixed
+// width, so nothing is counted per access.
+struct Counters {
+	uint64 ops[256]; // by opcode, stepped instructions only
+	uint64 taken[COUNTERS_BRANCHES];
+	uint64 not_taken[COUNTERS_BRANCHES];
+	int64 depth;     // calls minus rets
+	int64 max_depth;
+
+	void clear();
+};
+
+
+// bytes an instruction with this opcode reads and writes in RAM
+void op_memory(uint8 op, uint8 *read, uint8 *write);
+
+// JSON of every core and their sum. Once started, every SIGUSR1 writes it
+// to the file named, or to stderr without one; finish writes it one last
+// time at exit.
+void counters_write(FILE*, Core*, uint8 count);
+void counters_start(const char *name, Core*, uint8 count);
+void counters_finish();
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <utils.h>
+#include <bus.h>
+#include <memory.h>
+
+
+#define DISK_BASE (BUS_BASE + 0x1000)
+#define DISK_SIZE 0x1000
+
+// registers, offsets from DISK_BASE
+#define DISK_SUBMIT  0 // store the physical address of a DiskRequest to run it
+#define DISK_SECTORS 8 // load: size of the disk
+
+#define DISK_SECTOR 512
+
+#define DISK_READ  1 // disk to RAM
+#define DISK_WRITE 2 // RAM to disk
+
+#define DISK_OK    0
+#define DISK_ERROR 1 // bad command, outside the disk or RAM, read only or I/O error
+
+
+struct Core;
+
+
+// in guest RAM, 8 byte aligned. Addresses are physical, like DMA
+struct DiskRequest {
+	uint64 command;
+	uint64 sector;
+	uint64 count; // sectors
+	uint64 addr;  // in RAM
+	uint64 status;
+};
+
+
+// A host file as a disk. A request is one store of its address, the data
+// moves straight between the file and RAM before that store completes and
+// the core gets IRQ_DISK. Reads from a read only disk map whole pages of
+// the file copy-on-write where they line up with RAM, so the file must
+// not change while the guest runs. The last sector reads zeros past the
+// end of the file.
+struct Disk {
+	int fd;
+	bool readonly;
+	uint64 size; // bytes, atomic: every core submits on its own thread
+	uint64 sectors;
+
+	Disk();
+
+	bool open(const char *name, bool readonly);
+	void submit(Core*, uint64 addr);
+	uint64 run(Memory*, DiskRequest*);
+	bool read(Memory*, uint64 offset, uint64 addr, uint64 bytes);
+	bool write(Memory*, uint64 offset, uint64 addr, uint64 bytes);
+};
+
+
+extern Disk disk;
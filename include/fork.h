@@ -0,0 +1,35 @@
+#pragma once
+
+#include <utils.h>
+#include <register.h>
+
+
+#define FORK_MAX 4096
+
+
+struct Core;
+
+
+// register values one child starts with, on top of the forking core's
+struct ForkInput {
+	uint16 mask; // bit i set: regs[i] is replaced
+	uint64 regs[REGISTERS_COUNT];
+};
+
+
+// what the fork instruction turns into: `count` children, each a copy of
+// the machine sharing its RAM copy-on-write, the parent only waits
+struct Forks {
+	uint32 count;
+	ForkInput *inputs; // one per child, NULL when they differ by index only
+	uint32 index;      // of this process, from 1 in children, 0 in the parent
+
+	Forks();
+
+	bool load(const char *name);
+	uint32 spawn(int *status);
+	void resume(Core*, uint8 count);
+};
+
+
+extern Forks forks;
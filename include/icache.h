@@ -0,0 +1,51 @@
+#pragma once
+
+#include <utils.h>
+#include <register.h>
+
+
+#define ICACHE_BITS 12
+#define ICACHE_SIZE (1 << ICACHE_BITS)
+
+#define ICACHE_EMPTY ~0UL
+
+#define INSN_MAX 20 // opcode, 3 registers, 16 byte immediate
+
+#define INSN_END     1 // control flow leaves the straight line after this one
+#define INSN_ILLEGAL 2
+#define INSN_BRANCH  4 // conditional jump, counted taken or not
+#define INSN_CALL    8
+#define INSN_RET     16
+
+
+struct Core;
+struct Instruction;
+struct Memory;
+
+typedef void (*Handler)(Core*, Instruction*);
+
+
+struct Instruction {
+	uint64 addr; // LO + PC of the opcode byte
+	Handler handler;
+	uint8 op;
+	uint8 p1, p2, p3;
+	uint8 size;
+	uint8 flags;
+	Register imm;
+};
+
+
+struct ICache {
+	Instruction *entries;
+	Memory *mem;  // whose code_epoch it follows
+	uint64 epoch;
+
+	void init(Memory*);
+	void release();
+	void flush();
+
+	Instruction *slot(uint64 addr) {
+		return &entries[addr & (ICACHE_SIZE - 1)];
+	}
+};
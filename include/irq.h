@@ -0,0 +1,129 @@
+#pragma once
+
+#include <utils.h>
+
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+
+#define IRQ_LINES 64
+#define IRQ_TIMER    0 // the core's own timer
+#define IRQ_DOORBELL 1 // another core rang, see Irq::doorbell
+#define IRQ_DISK     2 // a disk request this core submitted is done
+
+#define TIMER_OFF ~0UL // timer_left while the instruction timer is off
+
+
+struct Core;
+
+
+// where a waiting core's thread sleeps. Each core has its own, under round
+// robin they all share the one thread's
+struct Waiter {
+	std::mutex lock;
+	std::condition_variable wake;
+};
+
+
+// A core's interrupt controller. Lines are posted from any thread without
+// a lock and taken by the core itself between blocks: the block loop only
+// tests pending & active, active being the mask while interrupts are on.
+// Taking one saves PC and the ALU flags here, turns interrupts off and
+// jumps to the handler in the vector table; iret undoes that. Handlers do
+// not nest. A core waiting in wfi sleeps until a line in the mask is
+// posted, whether interrupts are on or not.
+struct Irq {
+	uint64 pending;
+	uint64 mask;
+	bool enable;
+	uint64 active;
+
+	uint64 vector; // IRQ_LINES handler PCs, the table is at vector + LO
+	uint64 cause;  // line of the last one taken
+	uint64 pc;     // where iret returns to
+	uint64 flags;  // ALU flags iret restores
+
+	uint64 timer_insns; // instructions between timer interrupts, 0 is off
+	uint64 timer_left;
+	uint64 timer_ns;    // host time between them, 0 is off
+	uint64 timer_deadline;
+
+	uint64 doorbell; // bits rung by other cores since the core last read it
+
+	bool waiting; // its thread sleeps, posting has to wake it
+	Waiter own;
+	Waiter *waiter;
+
+	void clear();
+	bool sleep(uint64 until);
+	void wake();
+
+	// the sleeper sets waiting then checks pending, this does the opposite
+	// so that one of them sees the other
+	void post(uint8 line) {
+		__atomic_fetch_or(&pending, 1UL << line, __ATOMIC_SEQ_CST);
+
+		if (__atomic_load_n(&waiting, __ATOMIC_SEQ_CST))
+			wake();
+	}
+
+	void ring(uint64 bits) {
+		__atomic_fetch_or(&doorbell, bits, __ATOMIC_RELEASE);
+		post(IRQ_DOORBELL);
+	}
+
+	bool woken() {
+		return (__atomic_load_n(&pending, __ATOMIC_SEQ_CST) & mask) != 0;
+	}
+
+	bool ready() {
+		return (__atomic_load_n(&pending, __ATOMIC_RELAXED) & active) != 0;
+	}
+
+	void update() {
+		active = enable ? mask : 0;
+	}
+
+	// counts down the instruction timer, once per block. What a block ran
+	// past the expiry counts towards the next period
+	void tick(uint64 n) {
+		if (n < timer_left) {
+			timer_left -= n;
+			return;
+		}
+
+		post(IRQ_TIMER);
+
+		if (timer_insns != 0)
+			timer_left = timer_insns - (n - timer_left) % timer_insns;
+		else
+			timer_left = TIMER_OFF;
+	}
+};
+
+
+// the host time timers of every core, on one thread sleeping until the
+// next deadline. It only runs once some core set one
+struct Timers {
+	std::mutex lock;
+	std::condition_variable wake;
+	std::vector<Core*> armed;
+	std::thread *thread;
+	bool stopping;
+
+	Timers();
+	~Timers();
+
+	void set(Core*, uint64 ns);
+	void run();
+	void after_fork();
+	void stop();
+};
+
+
+extern Timers timers;
+
+
+uint64 now_ns();
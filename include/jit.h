@@ -0,0 +1,32 @@
+#pragma once
+
+#include <utils.h>
+#include <block.h>
+
+
+#define JIT_SIZE (16 * 1024 * 1024)
+#define JIT_THRESHOLD 16 // block executions before it gets compiled
+#define JIT_BLOCK_MAX (BLOCK_MAX * 160 + 64) // worst case code per block
+
+
+struct JitStats {
+	uint64 compiled;
+	uint64 runs;
+};
+
+
+// x86-64 code for hot blocks. Guest registers stay in Core::regs, which
+// the generated code addresses through rbx; anything it does not handle
+// natively (128-bit operands, idiv, hlt) calls the interpreter handler.
+struct Jit {
+	uint8 *buf;
+	uint64 used;
+
+	JitStats stats;
+
+	bool init();
+	void release();
+	void flush();
+
+	JitCode compile(Block*);
+};
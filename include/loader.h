@@ -0,0 +1,42 @@
+#pragma once
+
+#include <utils.h>
+#include <memory.h>
+
+
+#define IMAGE_MAGIC   0x494d5545 // "EUMI" read as little endian
+#define IMAGE_VERSION 1
+#define IMAGE_MAX_SEGMENTS 64
+
+
+// An image either starts with this header or is raw bytes loaded at one
+// address. All fields are little endian.
+struct ImageHeader {
+	uint32 magic;
+	uint16 version;
+	uint16 segments; // ImageSegment entries right after the header
+	uint64 pc;       // entry state for core 0
+	uint64 lo;
+	uint64 sp;
+};
+
+struct ImageSegment {
+	uint64 offset; // in the file
+	uint64 addr;   // in guest RAM
+	uint64 size;
+};
+
+
+struct ImageEntry {
+	bool valid; // false for raw images
+	uint64 pc, lo, sp;
+};
+
+
+// file bytes [offset, offset + size) to RAM at addr, copy-on-write pages
+// where the alignment allows
+bool map_range(Memory*, int fd, uint64 offset, uint64 addr, uint64 size);
+
+// maps the image into RAM, a raw one at addr: whole pages copy-on-write
+// straight from the file when the alignment allows, the ragged ends copied
+bool load_image(Memory*, const char *name, uint64 addr, ImageEntry*);
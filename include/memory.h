@@ -0,0 +1,91 @@
+#pragma once
+
+#include <utils.h>
+
+#include <string.h>
+
+
+// guest memory is little endian like the host, so a memcpy of the access
+// width compiles to one unaligned load or store, 128-bit ones included
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "guest memory accessors assume a little endian host"
+#endif
+
+
+#define MEMORY_GUARD (64 * 1024) // inaccessible bytes right after RAM
+#define MEMORY_HUGE (2 * 1024 * 1024) // huge page alignment
+
+#define CODE_LINE_SHIFT 6 // 64 byte lines
+
+
+// guest RAM. Callers check that a whole access lies inside RAM, one
+// compare, so a fault leaves RAM as it was. The bytes between the end of
+// RAM and the guard pages are never touched; the guard pages and their
+// SIGSEGV handler only catch what slips past a check.
+struct Memory {
+	uint8 *base;
+	uint64 size;
+
+	uint8 *map;
+	uint64 map_size;
+
+	// bytes mapped from files lie in [file_lo, file_hi), mincore() can not
+	// tell whether those hold data
+	uint64 file_lo, file_hi;
+
+	bool huge;
+
+	// a byte per 64 bytes of RAM, set once code decoded from that line is
+	// cached. Caches compare code_epoch before use and flush themselves
+	// when it moved. Every core on this RAM shares both, so every access
+	// is atomic; relaxed loads are plain moves on x86.
+	uint8 *code_lines;
+	uint64 code_line_count;
+	uint64 code_epoch;
+
+	bool init(uint64 size, bool huge);
+	void release();
+	bool clear();
+	void note_file(uint64 addr, uint64 size);
+
+	void code_mark(uint64 addr, uint64 size);
+	void code_invalidate(uint64 addr, uint64 size);
+	void code_write_range(uint64 addr, uint64 size);
+	void code_flush();
+
+	uint64 code_epoch_now() {
+		return __atomic_load_n(&code_epoch, __ATOMIC_ACQUIRE);
+	}
+
+	// called after every guest store, cheap unless it hits decoded code
+	void code_write(uint64 addr, uint64 _size) {
+		if (__atomic_load_n(&code_lines[addr >> CODE_LINE_SHIFT], __ATOMIC_RELAXED) |
+		    __atomic_load_n(&code_lines[(addr + _size - 1) >> CODE_LINE_SHIFT], __ATOMIC_RELAXED))
+			code_invalidate(addr, _size);
+	}
+
+	bool contains(uint64 addr) {
+		return addr < size;
+	}
+
+	// all of [addr, addr + bytes). RAM is larger than BIOS_OFFSET, so
+	// size - bytes does not wrap for any access width
+	bool contains(uint64 addr, uint64 bytes) {
+		return addr <= size - bytes;
+	}
+
+	bool in_guard(uint8 *p) {
+		return p >= map + map_size - MEMORY_GUARD && p < map + map_size;
+	}
+
+	template<class T> T load(uint64 addr) {
+		T val;
+		memcpy(&val, base + addr, sizeof(T));
+
+		return val;
+	}
+
+	template<class T> void store(uint64 addr, T val) {
+		memcpy(base + addr, &val, sizeof(T));
+	}
+};
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <utils.h>
+#include <memory.h>
+
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE  (1UL << PAGE_SHIFT)
+#define PAGE_MASK  (PAGE_SIZE - 1)
+
+// three levels of 512 eight byte entries, 39-bit virtual addresses
+#define MMU_LEVELS  3
+#define MMU_VA_BITS (PAGE_SHIFT + 9 * MMU_LEVELS)
+
+#define PTE_VALID 1
+#define PTE_WRITE 2 // leaf only
+#define PTE_EXEC  4 // leaf only
+
+#define MMU_READ  0
+#define MMU_WRITE 1
+#define MMU_EXEC  2
+
+#define TLB_BITS 8
+#define TLB_SIZE (1 << TLB_BITS)
+#define TLB_EMPTY ~0UL
+
+
+struct TlbEntry {
+	uint64 tag;  // virtual page number
+	uint64 page; // physical address of the page
+};
+
+struct TlbStats {
+	uint64 hits;
+	uint64 misses;
+};
+
+
+// Page tables live in guest RAM, each entry holds the physical address
+// of the next table or of the page in its upper bits and PTE_* below.
+// root is the physical address of the top table, 0 turns the MMU off.
+// Guests flush the TLB after changing an entry in use.
+struct Mmu {
+	uint64 root;
+	TlbEntry tlb[3][TLB_SIZE]; // one per MMU_READ, MMU_WRITE, MMU_EXEC
+	TlbStats stats;
+
+	void flush();
+	bool walk(Memory*, uint64 vaddr, uint8 access, uint64 *phys);
+
+	bool lookup(uint64 vaddr, uint8 access, uint64 *phys) {
+		TlbEntry *e = &tlb[access][(vaddr >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+
+		if (e->tag != vaddr >> PAGE_SHIFT)
+			return false;
+
+		stats.hits++;
+		*phys = e->page | (vaddr & PAGE_MASK);
+
+		return true;
+	}
+
+	// the physical address, false when the access has to fault
+	bool translate(Memory *mem, uint64 vaddr, uint8 access, uint64 *phys) {
+		return lookup(vaddr, access, phys) || walk(mem, vaddr, access, phys);
+	}
+};
+
+
+inline bool page_crossed(uint64 addr, uint64 size) {
+	return (addr & PAGE_MASK) + size > PAGE_SIZE;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <utils.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+
+#define PROFILE_HZ    997 // not a round number, so it does not beat with guest loops
+#define PROFILE_WORDS 512 // stack words scanned for return addresses
+#define PROFILE_DEPTH 64  // frames kept per sample
+
+
+struct Core;
+
+
+struct Symbol {
+	uint64 addr; // a guest PC, relative to LO like call targets
+	std::string name;
+};
+
+
+// Samples the PC of every running core from its own thread and, with
+// stacks on, the return addresses found on the guest stack. Those are
+// words above SP that point right behind a call instruction, a guess that
+// needs no frame pointers. Output is one "frame;frame;... count" line per
+// distinct stack, outermost frame first, as flame graph tools read it.
+struct Profiler {
+	Core *cores;
+	uint8 count;
+
+	uint32 hz;
+	bool stacks;
+	std::vector<Symbol> symbols; // sorted by addr
+
+	std::unordered_map<std::string, uint64> samples;
+	std::atomic<bool> stop;
+	std::thread *thread; // left alone in forked children, it is not there
+
+	Profiler();
+
+	bool load_symbols(const char *name);
+	void start(Core*, uint8 count);
+	bool finish(const char *name);
+
+	void sample(Core*);
+	void frame(std::string*, uint64 pc);
+};
+
+
+extern Profiler profiler;
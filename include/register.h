@@ -11,6 +11,10 @@
 #define FLAG_EQUALS 2
 #define FLAG_LESS 3
 #define FLAG_MORE 4
+#define FLAG_FORK 5 // stopped by fork, goes on in the children
+#define FLAG_WAITING 6 // stopped by wfi until an interrupt
+
+#define FLAGS_ALU ((1 << FLAG_EQUALS) | (1 << FLAG_LESS) | (1 << FLAG_MORE))
 
 
 union Register {
@@ -24,4 +28,13 @@ union Register {
 	int16 s;
 	uint8 ub;
 	int8 b;
+
+	template<class T> T &as();
 };
+
+
+template<> inline uint8   &Register::as<uint8>()   { return ub; }
+template<> inline uint16  &Register::as<uint16>()  { return us; }
+template<> inline uint32  &Register::as<uint32>()  { return ui; }
+template<> inline uint64  &Register::as<uint64>()  { return ul; }
+template<> inline uint128 &Register::as<uint128>() { return ur; }
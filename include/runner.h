@@ -0,0 +1,35 @@
+#pragma once
+
+#include <utils.h>
+
+
+#define RUN_FREE 0 // until hlt or a budget runs out
+#define RUN_STEP 1 // one instruction per line read from stdin
+
+#define STOP_HALTED  0
+#define STOP_INSNS   1
+#define STOP_TIMEOUT 2
+
+#define RUN_SLICE (1 << 20) // instructions between wall-clock checks
+
+
+struct Core;
+
+
+struct Runner {
+	uint8 mode;
+	uint64 max_insns;   // 0 is unlimited
+	double max_seconds; // 0 is unlimited
+
+	uint64 retired;
+	double seconds;
+
+	Runner();
+
+	uint8 run(Core*);
+	uint64 slice(Core*, uint64);
+	bool stepping();
+};
+
+
+double now();
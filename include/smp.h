@@ -0,0 +1,56 @@
+#pragma once
+
+#include <utils.h>
+#include <irq.h>
+
+#include <mutex>
+#include <condition_variable>
+
+
+#define CORE_IDLE    0 // parked until another core starts it
+#define CORE_RUNNING 1
+
+#define SMP_MAX 256
+
+#define SMP_THREADS 0 // a host thread per core
+#define SMP_RR      1 // all cores on one thread, in turns of `quantum`
+
+#define SMP_QUANTUM 10000
+
+
+struct Core;
+struct Runner;
+
+
+// runs the cores either on a host thread each, parked while their core is
+// idle, or deterministically in turns on one thread. The run ends once no
+// core is running, since nothing is left to start one
+struct Smp {
+	std::mutex lock;
+	std::condition_variable wake;
+
+	Core *cores;
+	uint8 count;
+	uint8 state[SMP_MAX];
+	uint32 running;
+	bool done;
+
+	uint8 mode;
+	uint64 quantum;
+	Waiter waiter; // round robin sleeps here while every core waits
+
+	Smp();
+
+	bool start(uint64 id, uint64 pc, uint64 sp, uint64 lo);
+	Core *core(uint8 id);
+	uint8 run(Runner*, Core*, uint8 count);
+
+	void adopt(Core*, uint8 count);
+	uint8 run_threads(Runner*);
+	uint8 run_rr(Runner*);
+	bool all_waiting();
+	bool sleep_rr(uint64 until);
+};
+
+
+extern Smp smp;
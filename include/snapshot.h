@@ -0,0 +1,62 @@
+#pragma once
+
+#include <utils.h>
+#include <register.h>
+#include <memory.h>
+
+#include <vector>
+
+
+#define SNAPSHOT_MAGIC   0x50414e53 // "SNAP" read as little endian
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_PAGE    4096       // RAM is saved in pages of this size
+
+
+struct Core;
+
+
+// A snapshot is this header, a SnapshotCore per core, the runs of saved
+// pages and their data. Pages missing from the runs are zero. Run data is
+// aligned like RAM on the host, so restoring maps it copy-on-write.
+struct SnapshotHeader {
+	uint32 magic;
+	uint16 version;
+	uint16 cores;
+	uint64 ram_size;
+	uint64 runs;
+};
+
+struct SnapshotCore {
+	Register regs[REGISTERS_COUNT];
+	uint64 flag;
+	uint64 mmu_root;
+
+	// see Irq, the host timer restarts its period on restore
+	uint64 irq_pending;
+	uint64 irq_mask;
+	uint64 irq_enable;
+	uint64 irq_vector;
+	uint64 irq_cause;
+	uint64 irq_pc;
+	uint64 irq_flags;
+	uint64 timer_insns;
+	uint64 timer_left;
+	uint64 timer_ns;
+	uint64 doorbell;
+};
+
+struct SnapshotRun {
+	uint64 addr; // in guest RAM, a multiple of SNAPSHOT_PAGE
+	uint64 size;
+	uint64 offset; // of the data in the file
+};
+
+
+// the parts of RAM holding anything but zeros, offsets left 0
+void snapshot_runs(Memory*, std::vector<SnapshotRun>*);
+
+bool snapshot_save(const char *name, Memory*, Core*, uint8 count);
+
+// the RAM size and core count RAM and cores have to be set up with
+bool snapshot_probe(const char *name, uint64 *ram_size, uint8 *count);
+bool snapshot_restore(const char *name, Memory*, Core*, uint8 count);
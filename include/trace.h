@@ -0,0 +1,29 @@
+#pragma once
+
+#include <utils.h>
+
+
+#define TRACE_OFF  0
+#define TRACE_INSN 1 // disassembly of every executed instruction
+#define TRACE_REGS 2 // plus the registers before each one
+
+#define TRACE_BUFFER (1 << 20)
+#define TRACE_LINE 512 // longest single write
+
+
+// buffered text sink for traced execution, written out in large chunks
+struct Trace {
+	FILE *out;
+	char *buf;
+	uint64 used;
+	uint8 level;
+
+	Trace();
+
+	bool open(const char*);
+	void write(const char*, ...);
+	void flush();
+};
+
+
+extern Trace trace;
@@ -28,3 +28,4 @@ typedef __int128           int128;
 
 
 void log_register(uint8);
+bool parse_assignment(const char*, uint8 *reg, uint64 *value);
@@ -0,0 +1,160 @@
+#include <irq.h>
+#include <core.h>
+#include <runner.h>
+
+#include <algorithm>
+#include <new>
+
+#include <signal.h>
+
+
+Timers timers;
+
+
+void Irq::clear() {
+	pending = 0;
+	mask = 0;
+	enable = false;
+	active = 0;
+
+	vector = 0;
+	cause = 0;
+	pc = 0;
+	flags = 0;
+
+	timer_insns = 0;
+	timer_left = TIMER_OFF;
+	timer_ns = 0;
+	timer_deadline = 0;
+
+	doorbell = 0;
+}
+
+
+Timers::Timers() {
+	thread = NULL;
+	stopping = false;
+}
+
+// the thread waits on members of this, it has to be gone before them
+Timers::~Timers() {
+	stop();
+}
+
+uint64 now_ns() {
+	return now() * 1e9;
+}
+
+
+// sleeps until woken() or the host time until, 0 is never. False when
+// until came first
+bool Irq::sleep(uint64 until) {
+	std::unique_lock<std::mutex> guard(waiter->lock);
+
+	__atomic_store_n(&waiting, true, __ATOMIC_SEQ_CST);
+
+	while (!woken()) {
+		uint64 t = now_ns();
+
+		if (until != 0 && t >= until)
+			break;
+
+		if (until == 0)
+			waiter->wake.wait(guard);
+		else
+			waiter->wake.wait_for(guard, std::chrono::nanoseconds(until - t));
+	}
+
+	__atomic_store_n(&waiting, false, __ATOMIC_SEQ_CST);
+
+	return woken();
+}
+
+// under the lock, so a sleeper between its check and wait() still gets it
+void Irq::wake() {
+	std::lock_guard<std::mutex> guard(waiter->lock);
+	waiter->wake.notify_all();
+}
+
+// starts the period from now, 0 stops the core's timer
+void Timers::set(Core *core, uint64 ns) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	core->irq.timer_ns = ns;
+	core->irq.timer_deadline = now_ns() + ns;
+
+	auto it = std::find(armed.begin(), armed.end(), core);
+
+	if (ns == 0 && it != armed.end())
+		armed.erase(it);
+
+	if (ns != 0 && it == armed.end())
+		armed.push_back(core);
+
+	if (thread == NULL && ns != 0)
+		thread = new std::thread(&Timers::run, this);
+
+	wake.notify_all();
+}
+
+// a restored snapshot starts this before counters_start() blocks SIGUSR1,
+// which only the counters reporter may take
+void Timers::run() {
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	std::unique_lock<std::mutex> guard(lock);
+
+	while (!stopping) {
+		uint64 t = now_ns();
+		uint64 next = ~0UL;
+
+		for (Core *c : armed) {
+			if (c->irq.timer_deadline <= t) {
+				c->irq.post(IRQ_TIMER);
+				c->irq.timer_deadline += c->irq.timer_ns;
+
+				// fell behind, say while the host was busy: no bursts
+				if (c->irq.timer_deadline <= t)
+					c->irq.timer_deadline = t + c->irq.timer_ns;
+			}
+
+			next = std::min(next, c->irq.timer_deadline);
+		}
+
+		if (next == ~0UL)
+			wake.wait(guard);
+		else
+			wake.wait_for(guard, std::chrono::nanoseconds(next - t));
+	}
+}
+
+// fork() only kept the calling thread: the timer thread and whatever it
+// held are gone in the child
+void Timers::after_fork() {
+	new (&lock) std::mutex;
+	new (&wake) std::condition_variable;
+
+	thread = NULL;
+
+	if (!armed.empty())
+		thread = new std::thread(&Timers::run, this);
+}
+
+void Timers::stop() {
+	if (thread == NULL)
+		return;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+		wake.notify_all();
+	}
+
+	thread->join();
+	delete thread;
+	thread = NULL;
+	stopping = false;
+}
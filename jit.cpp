@@ -0,0 +1,405 @@
+#include <jit.h>
+#include <core.h>
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RSI 6
+#define RDI 7
+
+#define REG(i) (uint32)(offsetof(Core, regs) + (i) * sizeof(Register))
+#define LAST_A (uint32)offsetof(Core, last_a)
+#define LAST_B (uint32)offsetof(Core, last_b)
+#define LAZY   (uint32)offsetof(Core, lazy_flags)
+#define INSN   (uint32)offsetof(Core, insn)
+
+
+static const uint8 widths[5]     = { 1, 2, 4, 8, 16 };
+static const uint8 mul_widths[5] = { 2, 4, 8, 16, 16 }; // mul widens
+
+
+struct Emitter {
+	uint8 *p;
+
+	void b(uint8 v) { *p++ = v; }
+	void d(uint32 v) { for (int i = 0; i < 4; i++) b(v >> (i * 8)); }
+	void q(uint64 v) { for (int i = 0; i < 8; i++) b(v >> (i * 8)); }
+
+	// ModRM for [rbx + disp32]
+	void mem(uint8 reg, uint32 disp) { b(0x83 | (reg << 3)); d(disp); }
+
+	// reg = zero extended w bytes at [rbx + disp]
+	void load(uint8 reg, uint8 w, uint32 disp) {
+		if (w == 1) { b(0x0f); b(0xb6); }
+		if (w == 2) { b(0x0f); b(0xb7); }
+		if (w == 4) { b(0x8b); }
+		if (w == 8) { b(0x48); b(0x8b); }
+		mem(reg, disp);
+	}
+
+	// low w bytes of reg to [rbx + disp]
+	void store(uint8 reg, uint8 w, uint32 disp) {
+		if (w == 1) { b(0x88); }
+		if (w == 2) { b(0x66); b(0x89); }
+		if (w == 4) { b(0x89); }
+		if (w == 8) { b(0x48); b(0x89); }
+		mem(reg, disp);
+	}
+
+	void mov_imm(uint8 reg, uint64 v) { b(0x48); b(0xb8 + reg); q(v); }
+
+	// reg += [rbx + disp]
+	void add_mem(uint8 reg, uint32 disp) { b(0x48); b(0x03); mem(reg, disp); }
+
+	// qword [rbx + disp] += / -= v
+	void add_qword(uint32 disp, uint32 v) { b(0x48); b(0x81); mem(0, disp); d(v); }
+	void sub_qword(uint32 disp, uint32 v) { b(0x48); b(0x81); mem(5, disp); d(v); }
+
+	// qword / byte [rbx + disp] = v
+	void set_qword(uint32 disp, uint32 v) { b(0x48); b(0xc7); mem(0, disp); d(v); }
+	void set_byte(uint32 disp, uint8 v) { b(0xc6); mem(0, disp); b(v); }
+
+	// rdi = core, then call the C function at fn
+	void call(void *fn) {
+		b(0x48); b(0x89); b(0xdf);
+		mov_imm(RAX, (uint64)fn);
+		b(0xff); b(0xd0);
+	}
+};
+
+
+static uint64 jit_pop1(Core *c, uint64 addr) { return c->pop1(addr); }
+static uint64 jit_pop2(Core *c, uint64 addr) { return c->pop2(addr); }
+static uint64 jit_pop4(Core *c, uint64 addr) { return c->pop4(addr); }
+static uint64 jit_pop8(Core *c, uint64 addr) { return c->pop8(addr); }
+
+static void jit_push1(Core *c, uint64 addr, uint64 val) { c->push((uint8)val, addr); }
+static void jit_push2(Core *c, uint64 addr, uint64 val) { c->push((uint16)val, addr); }
+static void jit_push4(Core *c, uint64 addr, uint64 val) { c->push((uint32)val, addr); }
+static void jit_push8(Core *c, uint64 addr, uint64 val) { c->push((uint64)val, addr); }
+
+static uint64 jit_condition(Core *c, uint64 cond) { return c->condition(cond); }
+
+static void *pops[9]   = { NULL, (void*)jit_pop1,  (void*)jit_pop2,  NULL, (void*)jit_pop4,  NULL, NULL, NULL, (void*)jit_pop8 };
+static void *pushes[9] = { NULL, (void*)jit_push1, (void*)jit_push2, NULL, (void*)jit_push4, NULL, NULL, NULL, (void*)jit_push8 };
+
+
+bool Jit::init() {
+	buf = (uint8*)mmap(NULL, JIT_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (buf == MAP_FAILED) {
+		buf = NULL;
+		return false;
+	}
+
+	used = 0;
+	stats.compiled = 0;
+	stats.runs = 0;
+
+	return true;
+}
+
+void Jit::release() {
+	if (buf != NULL)
+		munmap(buf, JIT_SIZE);
+
+	buf = NULL;
+}
+
+void Jit::flush() {
+	used = 0;
+}
+
+
+// records rax and rcx as the last ALU operands, like Core::ALU
+static void emit_operands(Emitter &e) {
+	e.store(RAX, 8, LAST_A);
+	e.set_qword(LAST_A + 8, 0);
+	e.store(RCX, 8, LAST_B);
+	e.set_qword(LAST_B + 8, 0);
+	e.set_byte(LAZY, 1);
+}
+
+// jumps over the next `skip` bytes unless the condition holds. When the
+// operands were recorded natively earlier in the block they fit in 64 bits
+// and are compared inline, otherwise Core::condition decides
+static void emit_condition(Emitter &e, uint8 cond, uint8 skip, bool narrow) {
+	static const uint8 skips[6] = {
+		0x75, // jne
+		0x74, // je
+		0x76, // jbe
+		0x72, // jb
+		0x73, // jae
+		0x77, // ja
+	};
+
+	if (narrow) {
+		e.load(RAX, 8, LAST_A);
+		e.b(0x48); e.b(0x3b); e.mem(RAX, LAST_B);         // cmp rax, [last_b]
+		e.b(skips[cond]); e.b(skip);
+		return;
+	}
+
+	e.mov_imm(RSI, cond);
+	e.call((void*)jit_condition);
+	e.b(0x84); e.b(0xc0);                                 // test al, al
+	e.b(0x74); e.b(skip);                                 // jz skip
+}
+
+// writes out the PC advance accumulated since the last sync
+static void emit_pc(Emitter &e, uint32 &pc) {
+	if (pc != 0)
+		e.add_qword(REG(REG_PC), pc);
+
+	pc = 0;
+}
+
+// before a call that can fault: PC and Core::insn as the interpreter
+// would have them
+static void emit_sync(Emitter &e, uint32 &pc, Instruction *in) {
+	emit_pc(e, pc);
+
+	e.mov_imm(RAX, (uint64)in);
+	e.store(RAX, 8, INSN);
+}
+
+// rsi = SP - below + LO
+static void emit_stack_addr(Emitter &e, uint8 below) {
+	e.load(RSI, 8, REG(REG_SP));
+
+	if (below != 0) {
+		e.b(0x48); e.b(0x83); e.b(0xee); e.b(below);      // sub rsi, below
+	}
+
+	e.add_mem(RSI, REG(REG_LO));
+}
+
+// true when the instruction was emitted natively, false before emitting
+// anything otherwise. narrow tracks whether the last ALU operands were
+// recorded by native code of this block
+static bool emit_native(Emitter &e, Instruction *in, uint32 &pc, bool &narrow) {
+	uint8 op = in->op;
+
+	if (op >= 0x02 && op <= 0x06) { // mov n
+		uint8 w = widths[op - 0x02];
+
+		if (w == 16)
+			return false;
+
+		e.mov_imm(RAX, in->imm.ul);
+		e.store(RAX, w, REG(in->p1));
+		return true;
+	}
+
+	if (op >= 0x07 && op <= 0x0b) { // mov r
+		uint8 w = widths[op - 0x07];
+
+		if (w == 16)
+			return false;
+
+		e.load(RAX, w, REG(in->p2));
+		e.store(RAX, w, REG(in->p1));
+		return true;
+	}
+
+	if (op >= 0x0c && op <= 0x29) { // mov from/to RAM, RAMg, RAMr
+		uint8 kind = (op - 0x0c) / 5;
+		uint8 w = widths[(op - 0x0c) % 5];
+		bool to_ram = kind & 1;
+
+		if (w == 16)
+			return false;
+
+		emit_sync(e, pc, in);
+
+		if (kind < 2) {
+			e.mov_imm(RSI, in->imm.ul);
+			e.add_mem(RSI, REG(REG_LO));
+		} else if (kind < 4) {
+			e.mov_imm(RSI, in->imm.ul);
+		} else {
+			e.load(RSI, 8, REG(in->p2));
+			e.add_mem(RSI, REG(REG_LO));
+		}
+
+		if (to_ram) {
+			e.load(RDX, w, REG(in->p1));
+			e.call(pushes[w]);
+		} else {
+			e.call(pops[w]);
+			e.store(RAX, w, REG(in->p1));
+		}
+
+		return true;
+	}
+
+	if (op >= 0x2a && op <= 0x33) { // push n, push r
+		uint8 w = widths[(op - 0x2a) % 5];
+
+		if (w == 16)
+			return false;
+
+		emit_sync(e, pc, in);
+		emit_stack_addr(e, w);
+
+		if (op <= 0x2e)
+			e.mov_imm(RDX, in->imm.ul);
+		else
+			e.load(RDX, w, REG(in->p1));
+
+		e.call(pushes[w]);
+		e.sub_qword(REG(REG_SP), w);
+		return true;
+	}
+
+	if (op >= 0x34 && op <= 0x38) { // pop
+		uint8 w = widths[op - 0x34];
+
+		if (w == 16)
+			return false;
+
+		emit_sync(e, pc, in);
+		emit_stack_addr(e, 0);
+		e.call(pops[w]);
+		e.store(RAX, w, REG(in->p1));
+		e.add_qword(REG(REG_SP), w);
+		return true;
+	}
+
+	if (op >= 0x39 && op <= 0x5b) { // sum, sub, mul, imul, div, idiv, cmp
+		uint8 kind = (op - 0x39) / 5;
+		uint8 w = kind == 2 ? mul_widths[(op - 0x39) % 5] : widths[(op - 0x39) % 5];
+		bool cmp = kind == 6;
+
+		if (w == 16 || kind == 5)
+			return false;
+
+		e.load(RAX, w, REG(cmp ? in->p1 : in->p2));
+		e.load(RCX, w, REG(cmp ? in->p2 : in->p3));
+
+		emit_operands(e);
+		narrow = true;
+
+		if (cmp)
+			return true;
+
+		if (kind == 0) {
+			e.b(0x48); e.b(0x01); e.b(0xc8);              // add rax, rcx
+		} else if (kind == 1) {
+			e.b(0x48); e.b(0x29); e.b(0xc8);              // sub rax, rcx
+		} else if (kind == 2 || kind == 3) {
+			e.b(0x48); e.b(0x0f); e.b(0xaf); e.b(0xc1);   // imul rax, rcx
+		} else {
+			e.b(0x48); e.b(0x85); e.b(0xc9);              // test rcx, rcx
+			e.b(0x74); e.b(7);                            // jz zero
+			e.b(0x31); e.b(0xd2);                         // xor edx, edx
+			e.b(0x48); e.b(0xf7); e.b(0xf1);              // div rcx
+			e.b(0xeb); e.b(2);                            // jmp done
+			e.b(0x31); e.b(0xc0);                         // zero: xor eax, eax
+		}
+
+		e.store(RAX, w, REG(in->p1));
+		return true;
+	}
+
+	if (op >= 0x5c && op <= 0x61) { // jcc n
+		emit_pc(e, pc);
+		emit_condition(e, op - 0x5c, 10 + 7, narrow);
+		e.mov_imm(RAX, in->imm.ul);
+		e.store(RAX, 8, REG(REG_PC));
+		return true;
+	}
+
+	if (op >= 0x62 && op <= 0x67) { // jcc r
+		emit_pc(e, pc);
+		emit_condition(e, op - 0x62, 7 + 7, narrow);
+		e.load(RAX, 8, REG(in->p1));
+		e.store(RAX, 8, REG(REG_PC));
+		return true;
+	}
+
+	if (op == 0x68 || op == 0x69) { // call, call r
+		emit_sync(e, pc, in);
+		emit_stack_addr(e, 8);
+		e.load(RDX, 8, REG(REG_PC));
+		e.call(pushes[8]);
+		e.sub_qword(REG(REG_SP), 8);
+
+		if (op == 0x68)
+			e.mov_imm(RAX, in->imm.ul);
+		else
+			e.load(RAX, 8, REG(in->p1));
+
+		e.store(RAX, 8, REG(REG_PC));
+		return true;
+	}
+
+	if (op == 0x6a) { // ret
+		emit_sync(e, pc, in);
+		emit_stack_addr(e, 0);
+		e.call(pops[8]);
+		e.store(RAX, 8, REG(REG_PC));
+		e.add_qword(REG(REG_SP), 8);
+		return true;
+	}
+
+	return false;
+}
+
+
+// PC is advanced lazily: the pending sum is written out before anything
+// that can observe it (helper calls, control flow) and at the block end
+JitCode Jit::compile(Block *b) {
+	if (buf == NULL || used + JIT_BLOCK_MAX > JIT_SIZE)
+		return NULL;
+
+	Emitter e;
+	e.p = buf + used;
+
+	uint8 *start = e.p;
+	uint32 pc = 0;
+	bool narrow = false;
+
+	e.b(0x53);                                            // push rbx
+	e.b(0x48); e.b(0x89); e.b(0xfb);                      // mov rbx, rdi
+
+	for (uint32 i = 0; i < b->count; i++) {
+		Instruction *in = &b->insns[i];
+
+		pc += in->size;
+
+		if (in->op == 0x00 && !(in->flags & INSN_ILLEGAL)) // nop
+			continue;
+
+		// native code reads and writes PC in place, so it has to be current.
+		// A write to it ends the block, nothing is left to add afterwards
+		if (in->p1 == REG_PC || in->p2 == REG_PC || in->p3 == REG_PC)
+			emit_pc(e, pc);
+
+		if (!(in->flags & INSN_ILLEGAL) && emit_native(e, in, pc, narrow))
+			continue;
+
+		emit_sync(e, pc, in);
+		narrow = false;
+
+		e.b(0x48); e.b(0x89); e.b(0xdf);                  // mov rdi, rbx
+		e.mov_imm(RSI, (uint64)in);
+		e.mov_imm(RAX, (uint64)in->handler);
+		e.b(0xff); e.b(0xd0);                             // call rax
+	}
+
+	emit_pc(e, pc);
+
+	e.b(0x5b);                                            // pop rbx
+	e.b(0xc3);                                            // ret
+
+	used = e.p - buf;
+	stats.compiled++;
+
+	return (JitCode)start;
+}
@@ -0,0 +1,110 @@
+#include <loader.h>
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+static bool copy(int fd, uint8 *dst, uint64 offset, uint64 size) {
+	while (size != 0) {
+		ssize_t n = pread(fd, dst, size, offset);
+
+		if (n <= 0)
+			return false;
+
+		dst += n;
+		offset += n;
+		size -= n;
+	}
+
+	return true;
+}
+
+// file bytes [offset, offset + size) to RAM at addr. A private mapping
+// needs the file offset and the host address to agree modulo the page
+// size, otherwise everything is copied
+bool map_range(Memory *mem, int fd, uint64 offset, uint64 addr, uint64 size) {
+	if (addr > mem->size || size > mem->size - addr) {
+		printf("segment at %016lx of %lu bytes does not fit in RAM!\n", addr, size);
+		return false;
+	}
+
+	uint64 page = sysconf(_SC_PAGESIZE);
+	uint8 *dst = mem->base + addr;
+
+	if ((uint64)dst % page != offset % page)
+		return copy(fd, dst, offset, size);
+
+	uint64 head = (page - (uint64)dst % page) % page;
+
+	if (head > size)
+		head = size;
+
+	uint64 pages = (size - head) / page * page;
+	uint64 tail = size - head - pages;
+
+	if (!copy(fd, dst, offset, head))
+		return false;
+
+	if (pages != 0 && mmap(dst + head, pages, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_FIXED, fd, offset + head) == MAP_FAILED)
+		return false;
+
+	if (pages != 0) {
+		mem->note_file(addr + head, pages);
+		LOG("mapped %lu bytes at %016lx, copied %lu\n", pages, addr + head, head + tail);
+	}
+
+	return copy(fd, dst + head + pages, offset + head + pages, tail);
+}
+
+
+bool load_image(Memory *mem, const char *name, uint64 addr, ImageEntry *entry) {
+	int fd = open(name, O_RDONLY);
+
+	if (fd < 0) {
+		printf("File %s not found!\n", name);
+		return false;
+	}
+
+	struct stat st;
+	fstat(fd, &st);
+
+	ImageHeader header;
+	bool ok;
+
+	entry->valid = false;
+
+	if (st.st_size < (off_t)sizeof(header) || !copy(fd, (uint8*)&header, 0, sizeof(header)) || header.magic != IMAGE_MAGIC) {
+		ok = map_range(mem, fd, 0, addr, st.st_size);
+	} else if (header.version != IMAGE_VERSION || header.segments > IMAGE_MAX_SEGMENTS) {
+		printf("%s: unsupported image version %d or %d segments\n", name, header.version, header.segments);
+		ok = false;
+	} else {
+		ImageSegment segments[IMAGE_MAX_SEGMENTS];
+
+		ok = copy(fd, (uint8*)segments, sizeof(header), header.segments * sizeof(ImageSegment));
+
+		for (int i = 0; ok && i < header.segments; i++) {
+			ImageSegment *s = &segments[i];
+
+			if (s->offset > (uint64)st.st_size || s->size > (uint64)st.st_size - s->offset) {
+				printf("%s: segment %d lies outside the file\n", name, i);
+				ok = false;
+			} else {
+				ok = map_range(mem, fd, s->offset, s->addr, s->size);
+			}
+		}
+
+		entry->valid = true;
+		entry->pc = header.pc;
+		entry->lo = header.lo;
+		entry->sp = header.sp;
+	}
+
+	close(fd);
+
+	return ok;
+}
@@ -0,0 +1,160 @@
+#include <memory.h>
+#include <core.h>
+
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+
+// a guest access ran into the guard pages: fault the core doing it. Any
+// other SIGSEGV is a host bug and gets the default action once it repeats
+static void on_segv(int sig, siginfo_t *info, void *context) {
+	Core *c = current_core;
+
+	if (c != NULL && c->fault_jmp != NULL && c->mem->in_guard((uint8*)info->si_addr))
+		c->fault(FAULT_BOUNDS, (uint8*)info->si_addr - c->mem->base);
+
+	signal(SIGSEGV, SIG_DFL);
+}
+
+
+// RAM starts as far into a host page as makes BIOS_OFFSET a page boundary,
+// so a raw BIOS is mapped from its file rather than copied. The guard
+// pages start at the next page boundary after RAM. Pages are zero filled
+// on first touch and not reserved, so untouched guest memory costs
+// nothing. With huge the mapping is aligned to and advised for
+// transparent huge pages.
+bool Memory::init(uint64 _size, bool _huge) {
+	static bool handler = false;
+
+	uint64 page = sysconf(_SC_PAGESIZE);
+	uint64 skew = (page - BIOS_OFFSET % page) % page;
+	uint64 span = (skew + _size + page - 1) / page * page;
+	uint64 align = _huge ? MEMORY_HUGE : page;
+
+	map_size = span + MEMORY_GUARD;
+
+	uint8 *raw = (uint8*)mmap(NULL, map_size + align - page, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	if (raw == MAP_FAILED)
+		return false;
+
+	// trim to an aligned start
+	map = (uint8*)(((uint64)raw + align - 1) & ~(align - 1));
+
+	uint64 head = map - raw;
+	uint64 tail = align - page - head;
+
+	if (head != 0)
+		munmap(raw, head);
+
+	if (tail != 0)
+		munmap(map + map_size, tail);
+
+	if (_huge)
+		madvise(map, span, MADV_HUGEPAGE);
+
+	if (mprotect(map + span, MEMORY_GUARD, PROT_NONE) != 0) {
+		munmap(map, map_size);
+		return false;
+	}
+
+	// mapped lazily like RAM itself
+	code_line_count = (_size >> CODE_LINE_SHIFT) + 1;
+	code_lines = (uint8*)mmap(NULL, code_line_count, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	code_epoch = 0;
+
+	if (code_lines == MAP_FAILED) {
+		munmap(map, map_size);
+		return false;
+	}
+
+	size = _size;
+	base = map + skew;
+
+	file_lo = size;
+	file_hi = 0;
+	huge = _huge;
+
+	if (!handler) {
+		struct sigaction sa;
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_sigaction = on_segv;
+		sa.sa_flags = SA_SIGINFO | SA_NODEFER; // faults unwind with siglongjmp
+
+		sigaction(SIGSEGV, &sa, NULL);
+		handler = true;
+	}
+
+	return true;
+}
+
+// gives RAM back, no core may use it any more
+void Memory::release() {
+	munmap(map, map_size);
+	munmap(code_lines, code_line_count);
+
+	map = base = NULL;
+	code_lines = NULL;
+}
+
+// all zeros again, in one call: fresh pages mapped over RAM give the old
+// ones back, file mappings included
+bool Memory::clear() {
+	uint64 span = map_size - MEMORY_GUARD;
+
+	if (mmap(map, span, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED)
+		return false;
+
+	if (huge)
+		madvise(map, span, MADV_HUGEPAGE);
+
+	file_lo = size;
+	file_hi = 0;
+
+	return true;
+}
+
+void Memory::note_file(uint64 addr, uint64 _size) {
+	if (addr < file_lo)
+		file_lo = addr;
+
+	if (addr + _size > file_hi)
+		file_hi = addr + _size;
+}
+
+
+// the instruction that faults on a fetch outside RAM may start past the end
+void Memory::code_mark(uint64 addr, uint64 _size) {
+	for (uint64 i = addr >> CODE_LINE_SHIFT; i <= (addr + _size - 1) >> CODE_LINE_SHIFT && i < code_line_count; i++)
+		__atomic_store_n(&code_lines[i], 1, __ATOMIC_RELAXED);
+}
+
+// a store hit decoded code: drop every cached copy. Caches compare their
+// epoch before use, so they flush themselves on the next lookup. Other
+// cores see the new epoch at their next block boundary.
+void Memory::code_invalidate(uint64 addr, uint64 _size) {
+	for (uint64 i = addr >> CODE_LINE_SHIFT; i <= (addr + _size - 1) >> CODE_LINE_SHIFT; i++)
+		__atomic_store_n(&code_lines[i], 0, __ATOMIC_RELAXED);
+
+	__atomic_fetch_add(&code_epoch, 1, __ATOMIC_RELEASE);
+}
+
+// like code_write() for a write of any size, a DMA transfer say
+void Memory::code_write_range(uint64 addr, uint64 _size) {
+	for (uint64 i = addr >> CODE_LINE_SHIFT; i <= (addr + _size - 1) >> CODE_LINE_SHIFT; i++) {
+		if (__atomic_load_n(&code_lines[i], __ATOMIC_RELAXED)) {
+			code_invalidate(addr, _size);
+			return;
+		}
+	}
+}
+
+// translations changed, every decoded copy may be stale
+void Memory::code_flush() {
+	__atomic_fetch_add(&code_epoch, 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,54 @@
+#include <mmu.h>
+#include <bus.h>
+
+
+void Mmu::flush() {
+	for (int a = 0; a < 3; a++)
+		for (int i = 0; i < TLB_SIZE; i++)
+			tlb[a][i].tag = TLB_EMPTY;
+}
+
+// a TLB miss: walks the tables and fills the entry. Tables have to lie in
+// RAM, pages in RAM or, except for code, on a device
+bool Mmu::walk(Memory *mem, uint64 vaddr, uint8 access, uint64 *phys) {
+	stats.misses++;
+
+	if (vaddr >> MMU_VA_BITS)
+		return false;
+
+	uint64 pte = 0;
+	uint64 table = root;
+
+	for (int level = MMU_LEVELS - 1; level >= 0; level--) {
+		uint64 at = table + ((vaddr >> (PAGE_SHIFT + 9 * level)) & 511) * 8;
+
+		if (at > mem->size - 8)
+			return false;
+
+		pte = mem->load<uint64>(at);
+
+		if (!(pte & PTE_VALID))
+			return false;
+
+		table = pte & ~PAGE_MASK;
+	}
+
+	if (access == MMU_WRITE && !(pte & PTE_WRITE))
+		return false;
+
+	if (access == MMU_EXEC && !(pte & PTE_EXEC))
+		return false;
+
+	bool ram = mem->size >= PAGE_SIZE && table <= mem->size - PAGE_SIZE;
+
+	if (!ram && (access == MMU_EXEC || bus.find(table, 1) == NULL))
+		return false;
+
+	TlbEntry *e = &tlb[access][(vaddr >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+	e->tag = vaddr >> PAGE_SHIFT;
+	e->page = table;
+
+	*phys = table | (vaddr & PAGE_MASK);
+
+	return true;
+}
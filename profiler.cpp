@@ -0,0 +1,185 @@
+#include <profiler.h>
+#include <core.h>
+
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+Profiler profiler;
+
+
+Profiler::Profiler() {
+	cores = NULL;
+	count = 0;
+	hz = PROFILE_HZ;
+	stacks = false;
+	stop = false;
+	thread = NULL;
+}
+
+
+// "ADDR NAME" lines, nm output works too since the name is the last word
+bool Profiler::load_symbols(const char *name) {
+	FILE *f = fopen(name, "r");
+
+	if (f == NULL) {
+		printf("File %s not found!\n", name);
+		return false;
+	}
+
+	char line[1024];
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char *comment = strchr(line, '#');
+
+		if (comment != NULL)
+			*comment = 0;
+
+		char *word = strtok(line, " \t\r\n");
+		char *last = NULL;
+
+		if (word == NULL)
+			continue;
+
+		Symbol s;
+		s.addr = strtoull(word, NULL, 16);
+
+		while ((word = strtok(NULL, " \t\r\n")) != NULL)
+			last = word;
+
+		if (last == NULL)
+			continue;
+
+		s.name = last;
+		symbols.push_back(s);
+	}
+
+	fclose(f);
+
+	std::sort(symbols.begin(), symbols.end(), [](const Symbol &a, const Symbol &b) { return a.addr < b.addr; });
+
+	return true;
+}
+
+// the symbol at or below pc, the address itself without one
+void Profiler::frame(std::string *out, uint64 pc) {
+	auto it = std::upper_bound(symbols.begin(), symbols.end(), pc,
+			[](uint64 pc, const Symbol &s) { return pc < s.addr; });
+
+	if (it != symbols.begin()) {
+		*out += (it - 1)->name;
+		return;
+	}
+
+	char text[24];
+	snprintf(text, sizeof(text), "0x%lx", pc);
+	*out += text;
+}
+
+
+static bool is_call_site(Memory *mem, uint64 lo, uint64 ret) {
+	uint64 at = ret + lo;
+
+	// call is 9 bytes with its address, call r 2 with its register
+	return (at >= 9 && at - 9 < mem->size && mem->base[at - 9] == 0x68) ||
+	       (at >= 2 && at - 2 < mem->size && mem->base[at - 2] == 0x69);
+}
+
+// reads the core while it runs: a torn sample is rare and only one of many.
+// With the MMU on, addresses are virtual and only the PC is taken
+void Profiler::sample(Core *c) {
+	uint64 pc = c->regs[REG_PC].ul;
+	uint64 lo = c->regs[REG_LO].ul;
+	uint64 sp = c->regs[REG_SP].ul + lo;
+
+	uint64 frames[PROFILE_DEPTH];
+	int depth = 0;
+
+	frames[depth++] = pc;
+
+	for (int i = 0; stacks && c->mmu.root == 0 && i < PROFILE_WORDS && depth < PROFILE_DEPTH; i++) {
+		uint64 at = sp + i * 8;
+
+		if (at > c->mem->size - 8)
+			break;
+
+		uint64 word = c->mem->load<uint64>(at);
+
+		if (is_call_site(c->mem, lo, word))
+			frames[depth++] = word - 1; // inside the caller, not after it
+	}
+
+	std::string stack;
+
+	if (count > 1) {
+		stack = "core";
+		stack += std::to_string(c->id);
+		stack += ";";
+	}
+
+	for (int i = depth - 1; i >= 0; i--) {
+		frame(&stack, frames[i]);
+
+		if (i != 0)
+			stack += ";";
+	}
+
+	samples[stack]++;
+}
+
+
+static void sampler(Profiler *p) {
+	timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	uint64 period = 1000000000UL / p->hz;
+
+	while (!p->stop) {
+		next.tv_nsec += period;
+
+		while (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		for (int i = 0; i < p->count; i++)
+			if ((p->cores[i].flag >> FLAG_RUNNING) & 1)
+				p->sample(&p->cores[i]);
+	}
+}
+
+void Profiler::start(Core *_cores, uint8 _count) {
+	cores = _cores;
+	count = _count;
+	stop = false;
+
+	samples.clear();
+
+	thread = new std::thread(sampler, this);
+}
+
+// stops sampling and writes the folded stacks to name
+bool Profiler::finish(const char *name) {
+	stop = true;
+	thread->join();
+
+	FILE *f = fopen(name, "w");
+
+	if (f == NULL) {
+		printf("Can not create %s!\n", name);
+		return false;
+	}
+
+	for (auto &s : samples)
+		fprintf(f, "%s %lu\n", s.first.c_str(), s.second);
+
+	fclose(f);
+
+	return true;
+}
@@ -0,0 +1,95 @@
+#include <runner.h>
+#include <core.h>
+#include <trace.h>
+
+#include <time.h>
+
+
+Runner::Runner() {
+	mode = RUN_FREE;
+	max_insns = 0;
+	max_seconds = 0;
+
+	retired = 0;
+	seconds = 0;
+}
+
+
+double now() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+// runs the core until it halts or a budget is used up, returns STOP_*.
+// Waiting in wfi sleeps on this thread
+uint8 Runner::run(Core *core) {
+	double start = now();
+	uint8 reason = STOP_HALTED;
+
+	for (;;) {
+		if (core->get_flag(FLAG_WAITING)) {
+			if (!core->irq.sleep(max_seconds != 0 ? (start + max_seconds) * 1e9 : 0)) {
+				reason = STOP_TIMEOUT;
+				break;
+			}
+
+			core->set_flag(FLAG_WAITING, 0);
+			core->set_flag(FLAG_RUNNING, 1);
+		}
+
+		if (!core->get_flag(FLAG_RUNNING))
+			break;
+
+		if (max_insns != 0 && retired >= max_insns) {
+			reason = STOP_INSNS;
+			break;
+		}
+
+		if (max_seconds != 0 && now() - start >= max_seconds) {
+			reason = STOP_TIMEOUT;
+			break;
+		}
+
+		uint64 n = stepping() ? 1 : RUN_SLICE;
+
+		if (max_insns != 0 && max_insns - retired < n)
+			n = max_insns - retired;
+
+		retired += slice(core, n);
+	}
+
+	seconds = now() - start;
+
+	return reason;
+}
+
+// executes up to n instructions, fewer if the core halts
+uint64 Runner::slice(Core *core, uint64 n) {
+	if (!stepping())
+		return core->run(n);
+
+	uint64 done = 0;
+
+	while (done < n && core->get_flag(FLAG_RUNNING)) {
+		if (trace.level != TRACE_OFF)
+			core->trace_step();
+		else
+			core->step();
+
+		done++;
+
+		if (mode == RUN_STEP) {
+			trace.flush();
+			getc(stdin);
+		}
+	}
+
+	return done;
+}
+
+bool Runner::stepping() {
+	return mode == RUN_STEP || trace.level != TRACE_OFF;
+}
@@ -0,0 +1,263 @@
+#include <smp.h>
+#include <core.h>
+#include <runner.h>
+
+#include <thread>
+
+
+Smp smp;
+
+
+Smp::Smp() {
+	cores = NULL;
+	count = 0;
+	running = 0;
+	done = false;
+
+	mode = SMP_THREADS;
+	quantum = SMP_QUANTUM;
+
+	for (int i = 0; i < SMP_MAX; i++)
+		state[i] = CORE_IDLE;
+}
+
+
+// sets up an idle core and wakes its thread, false if it does not exist
+// or is still running
+bool Smp::start(uint64 id, uint64 pc, uint64 sp, uint64 lo) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	if (id >= count || state[id] != CORE_IDLE || done)
+		return false;
+
+	Core *core = &cores[id];
+
+	core->clear();
+	core->regs[REG_PC].ul = pc;
+	core->regs[REG_SP].ul = sp;
+	core->regs[REG_LO].ul = lo;
+	core->set_flag(FLAG_RUNNING, 1);
+
+	state[id] = CORE_RUNNING;
+	running++;
+
+	wake.notify_all();
+
+	return true;
+}
+
+// NULL if it does not exist
+Core *Smp::core(uint8 id) {
+	return id < count ? &cores[id] : NULL;
+}
+
+
+struct CoreResult {
+	uint64 retired;
+	uint8 reason;
+};
+
+static void core_thread(Smp *s, Runner budget, uint8 id, CoreResult *result) {
+	Core *core = &s->cores[id];
+
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> guard(s->lock);
+			s->wake.wait(guard, [&] { return s->state[id] == CORE_RUNNING || s->done; });
+
+			if (s->state[id] != CORE_RUNNING)
+				return;
+		}
+
+		uint8 reason = budget.run(core);
+
+		std::lock_guard<std::mutex> guard(s->lock);
+
+		result->retired = budget.retired;
+
+		if (reason != STOP_HALTED)
+			result->reason = reason;
+
+		s->state[id] = CORE_IDLE;
+		s->running--;
+
+		if (s->running == 0) {
+			s->done = true;
+			s->wake.notify_all();
+		}
+	}
+}
+
+uint8 Smp::run(Runner *runner, Core *_cores, uint8 _count) {
+	double start = now();
+
+	adopt(_cores, _count);
+
+	uint8 reason = mode == SMP_RR ? run_rr(runner) : run_threads(runner);
+
+	runner->seconds = now() - start;
+
+	return reason;
+}
+
+// takes over the cores, counting those set up before the run as running,
+// like the boot core, or as waiting. A later run, say after a fork,
+// starts over
+void Smp::adopt(Core *_cores, uint8 _count) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	cores = _cores;
+	count = _count;
+	running = 0;
+
+	for (int i = 0; i < count; i++) {
+		state[i] = CORE_IDLE;
+		cores[i].irq.waiter = mode == SMP_RR ? &waiter : &cores[i].irq.own;
+
+		if (cores[i].get_flag(FLAG_RUNNING) || cores[i].get_flag(FLAG_WAITING)) {
+			state[i] = CORE_RUNNING;
+			running++;
+		}
+	}
+
+	done = running == 0;
+}
+
+// every core on its own thread until all of them halt, the budgets in
+// runner apply to each core. Returns STOP_HALTED unless some core ran out
+// of budget
+uint8 Smp::run_threads(Runner *runner) {
+	std::thread *threads = new std::thread[count];
+	CoreResult *results = new CoreResult[count];
+
+	for (int i = 0; i < count; i++) {
+		results[i].retired = 0;
+		results[i].reason = STOP_HALTED;
+
+		threads[i] = std::thread(core_thread, this, *runner, i, &results[i]);
+	}
+
+	uint8 reason = STOP_HALTED;
+
+	runner->retired = 0;
+
+	for (int i = 0; i < count; i++) {
+		threads[i].join();
+
+		runner->retired += results[i].retired;
+
+		if (results[i].reason != STOP_HALTED)
+			reason = results[i].reason;
+	}
+
+	delete[] threads;
+	delete[] results;
+
+	return reason;
+}
+
+// the cores take turns by id on this thread, `quantum` instructions each,
+// so a run is the same every time. A core started during a turn gets its
+// first one in the same round if its id is higher than the starter's.
+// Waiting cores sit their turns out, the thread sleeps once all of them do
+uint8 Smp::run_rr(Runner *runner) {
+	uint64 *retired = new uint64[count]();
+	uint8 reason = STOP_HALTED;
+	double start = now();
+
+	while (running != 0) {
+		if (runner->max_seconds != 0 && now() - start >= runner->max_seconds) {
+			reason = STOP_TIMEOUT;
+			break;
+		}
+
+		if (all_waiting() && !sleep_rr(runner->max_seconds != 0 ? (start + runner->max_seconds) * 1e9 : 0)) {
+			reason = STOP_TIMEOUT;
+			break;
+		}
+
+		for (int i = 0; i < count; i++) {
+			if (state[i] != CORE_RUNNING)
+				continue;
+
+			if (cores[i].get_flag(FLAG_WAITING)) {
+				if (!cores[i].irq.woken())
+					continue;
+
+				cores[i].set_flag(FLAG_WAITING, 0);
+				cores[i].set_flag(FLAG_RUNNING, 1);
+			}
+
+			uint64 n = quantum;
+
+			if (runner->max_insns != 0) {
+				if (runner->max_insns - retired[i] < n)
+					n = runner->max_insns - retired[i];
+
+				if (n == 0) {
+					reason = STOP_INSNS;
+					state[i] = CORE_IDLE;
+					running--;
+					continue;
+				}
+			}
+
+			retired[i] += runner->slice(&cores[i], n);
+
+			if (!cores[i].get_flag(FLAG_RUNNING) && !cores[i].get_flag(FLAG_WAITING)) {
+				state[i] = CORE_IDLE;
+				running--;
+			}
+		}
+	}
+
+	done = true;
+
+	runner->retired = 0;
+
+	for (int i = 0; i < count; i++)
+		runner->retired += retired[i];
+
+	delete[] retired;
+
+	return reason;
+}
+
+bool Smp::all_waiting() {
+	for (int i = 0; i < count; i++)
+		if (state[i] == CORE_RUNNING && !cores[i].get_flag(FLAG_WAITING))
+			return false;
+
+	return true;
+}
+
+// like Irq::sleep() for every waiting core at once, they share waiter.
+// False when until came first
+bool Smp::sleep_rr(uint64 until) {
+	std::unique_lock<std::mutex> guard(waiter.lock);
+	bool woken = false;
+
+	for (int i = 0; i < count; i++)
+		if (state[i] == CORE_RUNNING)
+			__atomic_store_n(&cores[i].irq.waiting, true, __ATOMIC_SEQ_CST);
+
+	for (;;) {
+		for (int i = 0; i < count; i++)
+			woken |= state[i] == CORE_RUNNING && cores[i].irq.woken();
+
+		uint64 t = now_ns();
+
+		if (woken || (until != 0 && t >= until))
+			break;
+
+		if (until == 0)
+			waiter.wake.wait(guard);
+		else
+			waiter.wake.wait_for(guard, std::chrono::nanoseconds(until - t));
+	}
+
+	for (int i = 0; i < count; i++)
+		__atomic_store_n(&cores[i].irq.waiting, false, __ATOMIC_SEQ_CST);
+
+	return woken;
+}
@@ -0,0 +1,290 @@
+#include <snapshot.h>
+#include <loader.h>
+#include <core.h>
+
+#include <vector>
+
+#include <stdio.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+#define SNAPSHOT_WINDOW (1UL << 30) // RAM asked about per mincore() call
+
+
+static bool write_at(int fd, const void *src, uint64 size, uint64 offset) {
+	const uint8 *p = (const uint8*)src;
+
+	while (size != 0) {
+		ssize_t n = pwrite(fd, p, size, offset);
+
+		if (n <= 0)
+			return false;
+
+		p += n;
+		offset += n;
+		size -= n;
+	}
+
+	return true;
+}
+
+static bool read_at(int fd, void *dst, uint64 size, uint64 offset) {
+	uint8 *p = (uint8*)dst;
+
+	while (size != 0) {
+		ssize_t n = pread(fd, p, size, offset);
+
+		if (n <= 0)
+			return false;
+
+		p += n;
+		offset += n;
+		size -= n;
+	}
+
+	return true;
+}
+
+
+static bool zero(const uint8 *p, uint64 size) {
+	return p[0] == 0 && memcmp(p, p + 1, size - 1) == 0;
+}
+
+// the pages worth saving, merged into runs. A page never touched is not
+// resident and reads as zero, so only resident ones get looked at, and
+// only those holding something else than zeros are kept
+void snapshot_runs(Memory *mem, std::vector<SnapshotRun> *runs) {
+	uint64 host = sysconf(_SC_PAGESIZE);
+	uint8 *resident = new uint8[SNAPSHOT_WINDOW / host + 2];
+
+	for (uint64 start = 0; start < mem->size; start += SNAPSHOT_WINDOW) {
+		uint64 end = start + SNAPSHOT_WINDOW < mem->size ? start + SNAPSHOT_WINDOW : mem->size;
+		uint8 *first = (uint8*)((uint64)(mem->base + start) & ~(host - 1));
+
+		if (mincore(first, mem->base + end - first, resident) != 0)
+			memset(resident, 1, SNAPSHOT_WINDOW / host + 2);
+
+		for (uint64 addr = start; addr < end; addr += SNAPSHOT_PAGE) {
+			uint64 size = end - addr < SNAPSHOT_PAGE ? end - addr : SNAPSHOT_PAGE;
+			uint8 *p = mem->base + addr;
+			bool used = addr < mem->file_hi && addr + size > mem->file_lo;
+
+			for (uint64 i = (p - first) / host; i <= (p + size - 1 - first) / host; i++)
+				used |= resident[i] & 1;
+
+			if (!used || zero(p, size))
+				continue;
+
+			if (!runs->empty() && runs->back().addr + runs->back().size == addr) {
+				runs->back().size += size;
+			} else {
+				SnapshotRun run = {addr, size, 0};
+				runs->push_back(run);
+			}
+		}
+	}
+
+	delete[] resident;
+}
+
+
+// written next to name and renamed over it, RAM may still map the old file
+bool snapshot_save(const char *name, Memory *mem, Core *cores, uint8 count) {
+	char temp[PATH_MAX];
+	snprintf(temp, sizeof(temp), "%s.tmp", name);
+
+	int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0) {
+		printf("Can not create %s!\n", temp);
+		return false;
+	}
+
+	std::vector<SnapshotRun> runs;
+	snapshot_runs(mem, &runs);
+
+	SnapshotHeader header;
+	header.magic = SNAPSHOT_MAGIC;
+	header.version = SNAPSHOT_VERSION;
+	header.cores = count;
+	header.ram_size = mem->size;
+	header.runs = runs.size();
+
+	uint64 host = sysconf(_SC_PAGESIZE);
+	uint64 pos = sizeof(header) + count * sizeof(SnapshotCore) + runs.size() * sizeof(SnapshotRun);
+
+	// same offset in a host page as in RAM, the restore can map it then
+	for (uint64 i = 0; i < runs.size(); i++) {
+		uint64 skew = (uint64)(mem->base + runs[i].addr) % host;
+
+		runs[i].offset = (pos - skew + host - 1) / host * host + skew;
+		pos = runs[i].offset + runs[i].size;
+	}
+
+	bool ok = write_at(fd, &header, sizeof(header), 0);
+	pos = sizeof(header);
+
+	for (int i = 0; ok && i < count; i++) {
+		Core *c = &cores[i];
+		SnapshotCore state;
+
+		if (c->lazy_flags)
+			c->materialize_flags();
+
+		memcpy(state.regs, c->regs, sizeof(state.regs));
+		state.flag = c->flag;
+		state.mmu_root = c->mmu.root;
+
+		state.irq_pending = __atomic_load_n(&c->irq.pending, __ATOMIC_ACQUIRE);
+		state.irq_mask = c->irq.mask;
+		state.irq_enable = c->irq.enable;
+		state.irq_vector = c->irq.vector;
+		state.irq_cause = c->irq.cause;
+		state.irq_pc = c->irq.pc;
+		state.irq_flags = c->irq.flags;
+		state.timer_insns = c->irq.timer_insns;
+		state.timer_left = c->irq.timer_left;
+		state.timer_ns = c->irq.timer_ns;
+		state.doorbell = __atomic_load_n(&c->irq.doorbell, __ATOMIC_ACQUIRE);
+
+		ok = write_at(fd, &state, sizeof(state), pos);
+		pos += sizeof(state);
+	}
+
+	ok = ok && write_at(fd, runs.data(), runs.size() * sizeof(SnapshotRun), pos);
+
+	for (uint64 i = 0; ok && i < runs.size(); i++)
+		ok = write_at(fd, mem->base + runs[i].addr, runs[i].size, runs[i].offset);
+
+	if (close(fd) != 0 || !ok || rename(temp, name) != 0) {
+		printf("Can not write %s!\n", name);
+		unlink(temp);
+		return false;
+	}
+
+	return true;
+}
+
+
+static bool read_header(int fd, const char *name, SnapshotHeader *header) {
+	if (!read_at(fd, header, sizeof(*header), 0) || header->magic != SNAPSHOT_MAGIC) {
+		printf("%s is not a snapshot\n", name);
+		return false;
+	}
+
+	if (header->version != SNAPSHOT_VERSION) {
+		printf("%s: unsupported snapshot version %d\n", name, header->version);
+		return false;
+	}
+
+	return true;
+}
+
+bool snapshot_probe(const char *name, uint64 *ram_size, uint8 *count) {
+	int fd = open(name, O_RDONLY);
+
+	if (fd < 0) {
+		printf("File %s not found!\n", name);
+		return false;
+	}
+
+	SnapshotHeader header;
+	bool ok = read_header(fd, name, &header);
+
+	if (ok && (header.cores < 1 || header.cores > 255)) {
+		printf("%s: %d cores\n", name, header.cores);
+		ok = false;
+	}
+
+	*ram_size = header.ram_size;
+	*count = header.cores;
+
+	close(fd);
+
+	return ok;
+}
+
+// into freshly set up RAM and cores, sized as snapshot_probe() said
+bool snapshot_restore(const char *name, Memory *mem, Core *cores, uint8 count) {
+	int fd = open(name, O_RDONLY);
+
+	if (fd < 0) {
+		printf("File %s not found!\n", name);
+		return false;
+	}
+
+	struct stat st;
+	fstat(fd, &st);
+
+	SnapshotHeader header;
+	bool ok = read_header(fd, name, &header);
+
+	if (ok && (header.ram_size != mem->size || header.cores != count)) {
+		printf("%s: RAM or core count changed\n", name);
+		ok = false;
+	}
+
+	uint64 pos = sizeof(header);
+
+	for (int i = 0; ok && i < count; i++) {
+		Core *c = &cores[i];
+		SnapshotCore state;
+
+		ok = read_at(fd, &state, sizeof(state), pos);
+		pos += sizeof(state);
+
+		if (!ok) {
+			printf("%s is truncated\n", name);
+			break;
+		}
+
+		c->clear();
+		memcpy(c->regs, state.regs, sizeof(state.regs));
+		c->flag = state.flag;
+		c->mmu.root = state.mmu_root;
+
+		c->irq.pending = state.irq_pending;
+		c->irq.mask = state.irq_mask;
+		c->irq.enable = state.irq_enable != 0;
+		c->irq.vector = state.irq_vector;
+		c->irq.cause = state.irq_cause;
+		c->irq.pc = state.irq_pc;
+		c->irq.flags = state.irq_flags;
+		c->irq.timer_insns = state.timer_insns;
+		c->irq.timer_left = state.timer_left;
+		c->irq.doorbell = state.doorbell;
+		c->irq.update();
+
+		if (state.timer_ns != 0)
+			timers.set(c, state.timer_ns);
+	}
+
+	if (ok && header.runs > (uint64)st.st_size / sizeof(SnapshotRun)) {
+		printf("%s is truncated\n", name);
+		ok = false;
+	}
+
+	for (uint64 i = 0; ok && i < header.runs; i++) {
+		SnapshotRun run;
+
+		ok = read_at(fd, &run, sizeof(run), pos);
+		pos += sizeof(run);
+
+		if (!ok) {
+			printf("%s is truncated\n", name);
+		} else if (run.offset > (uint64)st.st_size || run.size > (uint64)st.st_size - run.offset) {
+			printf("%s: run %lu lies outside the file\n", name, i);
+			ok = false;
+		}
+
+		ok = ok && map_range(mem, fd, run.offset, run.addr, run.size);
+	}
+
+	close(fd);
+
+	return ok;
+}
@@ -0,0 +1,52 @@
+#include <trace.h>
+
+#include <stdarg.h>
+
+
+Trace trace;
+
+
+Trace::Trace() {
+	out = stderr;
+	buf = NULL;
+	used = 0;
+	level = TRACE_OFF;
+}
+
+
+bool Trace::open(const char *name) {
+	out = fopen(name, "w");
+
+	if (out == NULL) {
+		out = stderr;
+		return false;
+	}
+
+	return true;
+}
+
+void Trace::write(const char *fmt, ...) {
+	if (buf == NULL)
+		buf = new char[TRACE_BUFFER];
+
+	if (used + TRACE_LINE > TRACE_BUFFER)
+		flush();
+
+	va_list args;
+	va_start(args, fmt);
+
+	int n = vsnprintf(buf + used, TRACE_LINE, fmt, args);
+
+	va_end(args);
+
+	if (n > 0)
+		used += n < TRACE_LINE ? n : TRACE_LINE - 1;
+}
+
+void Trace::flush() {
+	if (used != 0)
+		fwrite(buf, 1, used, out);
+
+	fflush(out);
+	used = 0;
+}
@@ -1,4 +1,24 @@
 #include <utils.h>
 
+#include <stdlib.h>
 
 
+
+// "rN=VALUE" as in fork inputs and batch manifests, false when malformed.
+// N is not checked against the register count
+bool parse_assignment(const char *word, uint8 *reg, uint64 *value) {
+	char *end;
+
+	if (word[0] != 'r' || word[1] < '0' || word[1] > '9')
+		return false;
+
+	long n = strtol(word + 1, &end, 10);
+
+	if (*end != '=' || n > 255)
+		return false;
+
+	*reg = n;
+	*value = strtoull(end + 1, &end, 0);
+
+	return *end == 0;
+}